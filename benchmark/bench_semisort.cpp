@@ -7,18 +7,21 @@
 #include <parlay/random.h>
 #include <parlay/io.h>
 
+#include <cstring>
 #include <iostream>
 #include <random>
+#include <string>
+#include <unordered_map>
 
-#include "../src/semisort.h"
-#include "genzipf.cpp"
+#include "../src/semisort_external.h"
+#include "../src/semisort_sharded.h"
+#include "../src/semisort_string.h"
+#include "semisort_inputs.h"
 
 using benchmark::Counter;
 
 using parlay::parallel_for;
 
-const float HASH_RANGE_K = constants::HASH_RANGE_K;
-
 // Use this macro to avoid accidentally timing the destructors
 // of the output produced by algorithms that return data
 //
@@ -54,78 +57,49 @@ const float HASH_RANGE_K = constants::HASH_RANGE_K;
   state.counters["    Elements/sec"] = Counter(state.iterations()*(n), Counter::kIsRate);                                            \
   state.counters["       Bytes/sec"] = Counter(state.iterations()*(n)*(sizeof(T)), Counter::kIsRate);
 
-// ------------------------- Input generation methods -------------------------------
-
+// Report the scratch memory used by the last semisort call
 //
-// Return uniform_distributions input, note that the records are already hashed
+// Arguments:
+//  fp:            The SemisortFootprint filled in by semi_sort
 //
-static parlay::sequence<record<uint64_t, uint64_t>> uniform_distribution_input(size_t n, size_t para) {
-  
-  std::default_random_engine generator;
-  std::uniform_int_distribution<uint64_t> distribution(0, para);
-  uint64_t k = pow(n, HASH_RANGE_K);
-  uint64_t key;
-
-  parlay::sequence<record<uint64_t, uint64_t>> arr(n);
-  parallel_for (size_t i = 0; i < n; i++) {
-    key = distribution(generator);
-    record<uint64_t, uint64_t> elt = {
-      0,
-      key,
-      static_cast<int>(parlay::hash64(key) % k)
-    };
-    arr[i] = elt;
-  }
-
-  return arr;
-}
+#define REPORT_FOOTPRINT(fp)                                                                                                         \
+  state.counters["  Bucket slots/n"] = Counter((double)(fp).bucket_slots / (fp).n);                                                  \
+  state.counters[" Scratch bytes/n"] = Counter((double)(fp).peak_bytes / (fp).n);                                                    \
+  state.counters["   Scratch bytes"] = Counter((double)(fp).peak_bytes, Counter::kDefaults, Counter::kIs1024);
 
+// Report the per call phase times and counters semisort added to a SemisortStats;
+// they stay 0 unless the benchmarks are built with SEMISORT_STATS
 //
-// Return exponential_distribution input, note that the records are already hashed
-//
-static parlay::sequence<record<uint64_t, uint64_t>> exponential_distribution_input(size_t n, size_t para) {
-  
-  std::default_random_engine generator;
-  std::exponential_distribution<double> distribution(para);
-  uint64_t k = pow(n, HASH_RANGE_K);
-  uint64_t key;
-
-  parlay::sequence<record<uint64_t, uint64_t>> arr(n);
-  parallel_for (size_t i = 0; i < n; i++) {
-    key = static_cast<uint64_t>(n * distribution(generator));
-    record<uint64_t, uint64_t> elt = {
-      0,
-      key,
-      static_cast<int>(parlay::hash64(key) % k)
-    };
-    arr[i] = elt;
-  }
-
-  return arr;
-}
-
-//
-// Return zipfian_distribution input, note that the records are already hashed
+// Arguments:
+//  st:            The SemisortStats passed in SemisortConfig::stats
 //
-static parlay::sequence<record<uint64_t, uint64_t>> zipfian_distribution_input(size_t n, size_t para) {
-  
-  rand_val(1);
-  uint64_t k = pow(n, HASH_RANGE_K);
-  uint64_t key;
-
-  parlay::sequence<record<uint64_t, uint64_t>> arr(n);
-  parallel_for (size_t i = 0; i < n; i++) {
-    key = static_cast<uint64_t>(zipf(1.0, para)); // according to section 5.1: "the i-th number in this range has a probability 1/(iM-) of being chosen..."
-    record<uint64_t, uint64_t> elt = {
-      0,
-      key,
-      static_cast<int>(parlay::hash64(key) % k)
-    };
-    arr[i] = elt;
-  }
-
-  return arr;
-}
+#define REPORT_SEMISORT_STATS(st)                                                                                                    \
+  double calls = std::max((size_t)1, (st).calls);                                                                                    \
+  state.counters["    Hash seconds"] = Counter((st).hash_seconds / calls);                                                           \
+  state.counters["  Sample seconds"] = Counter((st).sample_seconds / calls);                                                         \
+  state.counters["Sample sort secs"] = Counter((st).sort_samples_seconds / calls);                                                   \
+  state.counters["  Sizing seconds"] = Counter((st).bucket_sizes_seconds / calls);                                                   \
+  state.counters[" Scatter seconds"] = Counter((st).scatter_seconds / calls);                                                        \
+  state.counters[" Light sort secs"] = Counter((st).light_sort_seconds / calls);                                                     \
+  state.counters["    Pack seconds"] = Counter((st).pack_seconds / calls);                                                           \
+  state.counters["      Heavy keys"] = Counter((st).num_heavy_keys / calls);                                                         \
+  state.counters["   Light buckets"] = Counter((st).num_light_buckets / calls);                                                      \
+  state.counters["      Fill ratio"] = Counter((st).fill_ratio());                                                                   \
+  state.counters["    Probe length"] = Counter((st).mean_probe_length());                                                            \
+  state.counters["    CAS failures"] = Counter((st).cas_failures / calls);                                                           \
+  state.counters["     Wraparounds"] = Counter((st).wraparounds / calls);                                                            \
+  state.counters["Max probe length"] = Counter((st).max_probe_length);
+
+// Fixed size payload for the record layout benchmarks
+template <size_t N>
+struct Payload {
+  char bytes[N];
+
+  bool operator!=(const Payload &b) const { return memcmp(bytes, b.bytes, N) != 0; }
+};
+
+template <size_t N>
+std::ostream &operator<<(std::ostream &os, const Payload<N> &) { return os << "payload<" << N << ">"; }
 
 // Helper function to print keys of sequence for debugging
 template<class Object, class Key>
@@ -148,19 +122,18 @@ static void bench_semisort_figure1_a(benchmark::State& state) {
   size_t para = state.range(0);
   // std::cout << "figure1_a_exponential distribution: para = " << para << std::endl;
   auto in = exponential_distribution_input(n, para);
-  if DEBUG {
-    print_sequence_key(in);
-  }
   auto out = in;
+  SemisortFootprint footprint;
 
   while (state.KeepRunningBatch(10)) {
     for (int i = 0; i < 10; i++) {
       COPY_NO_TIME(out, in);
-      semi_sort(out); // here does not check for correctness
+      semi_sort(out, SemisortConfig(), &footprint); // here does not check for correctness
     }
   }
 
   REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
 }
 
 //
@@ -173,15 +146,17 @@ static void bench_semisort_figure1_b(benchmark::State& state) {
   std::cout << "figure1_b_uniform distribution: para = " << para << std::endl;
   auto in = uniform_distribution_input(n, para);
   auto out = in;
+  SemisortFootprint footprint;
 
   while (state.KeepRunningBatch(10)) {
     for (int i = 0; i < 10; i++) {
       COPY_NO_TIME(out, in);
-      semi_sort(out); // here does not check for correctness
+      semi_sort(out, SemisortConfig(), &footprint); // here does not check for correctness
     }
   }
 
   REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
 }
 
 //
@@ -194,15 +169,17 @@ static void bench_semisort_figure1_c(benchmark::State& state) {
   std::cout << "figure1_c_zipfian distribution: para = " << para << std::endl;
   auto in = zipfian_distribution_input(n, para);
   auto out = in;
+  SemisortFootprint footprint;
 
   while (state.KeepRunningBatch(10)) {
     for (int i = 0; i < 10; i++) {
       COPY_NO_TIME(out, in);
-      semi_sort(out); // here does not check for correctness
+      semi_sort(out, SemisortConfig(), &footprint); // here does not check for correctness
     }
   }
 
   REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
 }
 
 //
@@ -213,15 +190,17 @@ static void bench_semisort_figure2_a(benchmark::State& state) {
   size_t n = 100000000;
   auto in = exponential_distribution_input(100000000, 100000); // figure2 has fixed size and para
   auto out = in;
+  SemisortFootprint footprint;
 
   while (state.KeepRunningBatch(10)) {
     for (int i = 0; i < 10; i++) {
       COPY_NO_TIME(out, in);
-      semi_sort(out); // here does not check for correctness
+      semi_sort(out, SemisortConfig(), &footprint); // here does not check for correctness
     }
   }
 
   REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
 }
 
 //
@@ -232,17 +211,502 @@ static void bench_semisort_figure2_b(benchmark::State& state) {
   size_t n = 100000000;
   auto in = uniform_distribution_input(100000000, 100000000); // figure2 has fixed size and para
   auto out = in;
+  SemisortFootprint footprint;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort(out, SemisortConfig(), &footprint); // here does not check for correctness
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
+}
+
+//
+// Benchmark repeated small batches that share one SemisortWorkspace, as a service
+// semisorting a new batch every few milliseconds would
+//
+template<typename T>
+static void bench_semisort_workspace(benchmark::State& state) {
+  size_t n = state.range(0);
+  auto in = uniform_distribution_input(n, n / 10);
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+  SemisortFootprint footprint;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_without_alloc(out, ws, SemisortConfig(), &footprint);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
+}
+
+//
+// Benchmark aggregating zipfian input by semisorting and then reducing every group
+//
+template<typename T>
+static void bench_semisort_group_then_reduce(benchmark::State& state) {
+  size_t n = 10000000;
+  size_t para = state.range(0);
+  auto in = zipfian_distribution_input(n, para);
+  auto out = in;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      auto groups = semisort_group_by(out);
+      RUN_AND_CLEAR(parlay::map(groups, [](auto& group) {
+        return parlay::reduce(parlay::delayed_seq<uint64_t>(group.second.size(), [&](size_t j) { return group.second[j].obj; }));
+      }));
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+}
+
+//
+// Benchmark aggregating zipfian input by reducing straight out of the buckets
+//
+template<typename T>
+static void bench_semisort_reduce_by_key(benchmark::State& state) {
+  size_t n = 10000000;
+  size_t para = state.range(0);
+  auto in = zipfian_distribution_input(n, para);
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      RUN_AND_CLEAR(semisort_reduce_by_key(in, parlay::addm<uint64_t>(), ws));
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+}
+
+//
+// Benchmark the fused single-pass scatter against the separate heavy and light
+// passes on uniform input. The two-pass scatter streams the input twice, which
+// the bandwidth counter accounts for.
+//
+template<typename T>
+static void bench_semisort_scatter_passes(benchmark::State& state) {
+  size_t n = 100000000;
+  size_t para = state.range(0);
+  SemisortConfig config;
+  config.fused_scatter = state.range(1);
+  auto in = uniform_distribution_input(n, para);
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_without_alloc(out, ws, config);
+    }
+  }
+
+  size_t scatter_passes = config.fused_scatter ? 1 : 2;
+  REPORT_STATS(n, scatter_passes * sizeof(record<uint64_t, uint64_t>), sizeof(record<uint64_t, uint64_t>));
+}
+
+//
+// Benchmark the RandomCas (0), CountingPlace (1), PrefetchCas (2) and StagedCas
+// (3) scatter engines on uniform (0), zipfian (1) and exponential (2) input.
+// Cache and TLB misses of the scatter are best read from all worker threads at
+// once, e.g.
+//   perf stat -e LLC-load-misses,LLC-store-misses,dTLB-load-misses,dTLB-store-misses
+//     ./bench_semisort --benchmark_filter=scatter_engine
+//
+template<typename T>
+static void bench_semisort_scatter_engine(benchmark::State& state) {
+  size_t n = 10000000;
+  size_t para = state.range(1);
+  SemisortConfig config;
+  config.scatter_engine = static_cast<ScatterEngine>(state.range(2));
+  auto in = (state.range(0) == 0) ? uniform_distribution_input(n, para)
+          : (state.range(0) == 1) ? zipfian_distribution_input(n, para)
+                                  : exponential_distribution_input(n, para);
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+  SemisortFootprint footprint;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_without_alloc(out, ws, config, &footprint);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
+}
+
+//
+// Benchmark bucket array placement on the figure 2 workloads (0 exponential,
+// 1 uniform): 0 naive first touch, 1 interleaved over all nodes, 2 node local
+// slices with the node aware scatter. Compare against the numactl_bench target,
+// which interleaves every allocation, not just the buckets.
+//
+template<typename T>
+static void bench_semisort_numa(benchmark::State& state) {
+  size_t n = 100000000;
+  auto in = (state.range(0) == 0) ? exponential_distribution_input(n, 100000) : uniform_distribution_input(n, n);
+  SemisortConfig config;
+  config.numa_placement = static_cast<NumaPlacement>(state.range(1));
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_without_alloc(out, ws, config);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+  state.counters["      NUMA nodes"] = Counter(semisort_numa_nodes());
+}
+
+//
+// Benchmark semisorting records in place (0) against semisorting (index, hashed_key)
+// pairs and gathering the payloads at the end (1), for payloads of sizeof(T) bytes
+//
+template<typename T>
+static void bench_semisort_payload(benchmark::State& state) {
+  size_t n = 10000000;
+  SemisortConfig config;
+  config.sort_by_index = state.range(0);
+  auto keys = uniform_distribution_input(n, n);
+  parlay::sequence<record<T, uint64_t>> in(n);
+  parallel_for(0, n, [&](size_t i) {
+    in[i] = {T(), keys[i].key, keys[i].hashed_key};
+  });
+  auto out = in;
+  SemisortWorkspace<T, uint64_t> ws;
+  SemisortIndexWorkspace<T, uint64_t> index_ws;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      if (config.sort_by_index) {
+        semi_sort_by_index(out, index_ws, config);
+      } else {
+        semi_sort_without_alloc(out, ws, config);
+      }
+    }
+  }
+
+  REPORT_STATS(n, sizeof(record<T, uint64_t>), sizeof(record<T, uint64_t>));
+}
+
+//
+// Benchmark semisort_indices on a bare key column of size n
+//
+template<typename T>
+static void bench_semisort_indices(benchmark::State& state) {
+  size_t n = state.range(0);
+  auto in = uniform_distribution_input(n, n);
+  auto keys = parlay::map(in, [](const record<uint64_t, uint64_t> &r) { return (T)r.key; });
+  SemisortIndexWorkspace<uint32_t, uint32_t> ws;
+
+  for (auto _ : state) {
+    auto result = semisort_indices(keys, ws);
+    benchmark::DoNotOptimize(result);
+  }
+
+  REPORT_STATS(n, sizeof(T), sizeof(uint32_t));
+}
+
+//
+// Benchmark hashing n integer keys with each multiply-shift kernel:
+// 0 scalar, 1 AVX2, 2 AVX-512
+//
+template<typename T>
+static void bench_hash_keys(benchmark::State& state) {
+  size_t n = state.range(0);
+  HashKernel kernel = (HashKernel)state.range(1);
+  if (!hash_kernel_supported(kernel)) {
+    state.SkipWithError("hash kernel not supported on this cpu");
+    return;
+  }
+  auto out = uniform_distribution_input(n, n);
+  uint32_t bits = hash_range_bits(n);
+
+  for (auto _ : state) {
+    hash_keys(
+      n, bits, [&](size_t i) { return out[i].key; },
+      [&](size_t i, uint64_t hashed_key) { out[i].hashed_key = hashed_key; }, MULTIPLY_SHIFT_SEED, kernel);
+  }
+
+  REPORT_STATS(n, sizeof(record<T, uint64_t>), sizeof(uint64_t));
+}
+
+//
+// Benchmark grouping n url-like string keys with para distinct values, hashed
+// straight out of one arena (0) against interning them into integer ids with a
+// hash map and semisorting the ids (1)
+//
+template<typename T>
+static void bench_semisort_string_keys(benchmark::State& state) {
+  size_t n = 10000000;
+  size_t para = state.range(0);
+  bool intern = state.range(1);
+  auto ids = zipfian_distribution_input(n, para);
+  std::string data;
+  std::vector<uint64_t> offsets(1, 0);
+  for (size_t i = 0; i < n; i++) {
+    data += "https://example.com/tenant/" + std::to_string(ids[i].key) + "/index.html";
+    offsets.push_back(data.size());
+  }
+  StringKeyArena keys{data, offsets.data(), n};
+  SemisortIndexWorkspace<uint32_t, uint32_t> ws;
+
+  for (auto _ : state) {
+    if (intern) {
+      std::unordered_map<std::string_view, uint64_t> interned;
+      parlay::sequence<uint64_t> key_ids(n);
+      for (size_t i = 0; i < n; i++)
+        key_ids[i] = interned.emplace(keys[i], interned.size()).first->second;
+      auto result = semisort_indices(key_ids, ws);
+      benchmark::DoNotOptimize(result);
+    } else {
+      auto result = semisort_string_keys(keys, ws);
+      benchmark::DoNotOptimize(result);
+    }
+  }
+
+  REPORT_STATS(n, data.size() / n, sizeof(uint32_t));
+}
+
+//
+// Benchmark semi_sort_with_hash grouping by hashed key (exact 0) against exact
+// grouping (exact 1) over hash_bits wide hashed keys (0 for hash_range_bits(n))
+//
+template<typename T>
+static void bench_semisort_exact_keys(benchmark::State& state) {
+  size_t n = 10000000;
+  size_t para = state.range(0);
+  SemisortConfig config;
+  config.exact_keys = state.range(1);
+  config.hash_bits = state.range(2);
+  auto in = uniform_distribution_input(n, para);
+  auto out = in;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_with_hash(out, config);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+}
+
+//
+// Benchmark semi_sort_external on a file of n records (0 uniform, 1 exponential
+// keys) under a memory budget of budget_mb MiB. Disk bandwidth counts every byte
+// the sample, spill and sort passes read or wrote, over the whole run.
+//
+template<typename T>
+static void bench_semisort_external(benchmark::State& state) {
+  size_t n = state.range(0);
+  auto in = (state.range(1) == 0) ? uniform_distribution_input(n, n) : exponential_distribution_input(n, 10);
+  ExternalSemisortConfig config;
+  config.memory_budget_bytes = (size_t)state.range(2) << 20;
+  std::string input_path = config.spill_directory + "/semisort_external_input.bin";
+  std::string output_path = config.spill_directory + "/semisort_external_output.bin";
+  FILE *input = fopen(input_path.c_str(), "wb");
+  fwrite(in.data(), sizeof(record<uint64_t, uint64_t>), n, input);
+  fclose(input);
+  ExternalSemisortStats stats;
+  double disk_bytes = 0;
+
+  for (auto _ : state) {
+    stats = semi_sort_external<uint64_t, uint64_t>(input_path, output_path, config);
+    disk_bytes += stats.bytes_read + stats.bytes_written;
+  }
+  remove(input_path.c_str());
+  remove(output_path.c_str());
+
+  REPORT_STATS(n, 0, 0);
+  state.counters["  Disk bandwidth"] = Counter(disk_bytes, Counter::kIsRate, Counter::kIs1024);
+  state.counters["      Partitions"] = Counter(stats.num_light_partitions + stats.num_heavy_partitions);
+  state.counters["  Sample seconds"] = Counter(stats.sample_seconds);
+  state.counters["   Spill seconds"] = Counter(stats.spill_seconds);
+  state.counters["    Sort seconds"] = Counter(stats.sort_seconds);
+}
+
+//
+// Benchmark semi_sort_sharded with 1-16 forked worker processes exchanging
+// records through shared memory, on n uniform (0) or zipfian (1) keys
+//
+template<typename T>
+static void bench_semisort_sharded(benchmark::State& state) {
+  size_t n = 10000000;
+  size_t num_workers = state.range(1);
+  auto in = (state.range(0) == 0) ? uniform_distribution_input(n, n) : zipfian_distribution_input(n, 1000000);
+  auto out = in;
+  ShardedSemisortStats stats;
+
+  while (state.KeepRunningBatch(5)) {
+    for (int i = 0; i < 5; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_sharded(out, num_workers, SemisortConfig(), &stats);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+  state.counters["      Heavy keys"] = Counter(stats.num_heavy_keys);
+  state.counters["   Largest shard"] = Counter(stats.largest_shard);
+  state.counters["  Sample seconds"] = Counter(stats.sample_seconds);
+  state.counters["Exchange seconds"] = Counter(stats.exchange_seconds);
+  state.counters["    Sort seconds"] = Counter(stats.sort_seconds);
+}
+
+//
+// Break semi_sort_with_hash down into its phases for uniform (0), zipfian (1)
+// and exponential (2) keys under each scatter engine; build with -DSEMISORT_STATS=ON
+//
+template<typename T>
+static void bench_semisort_phases(benchmark::State& state) {
+  size_t n = 10000000;
+  auto in = (state.range(0) == 0) ? uniform_distribution_input(n, n)
+          : (state.range(0) == 1) ? zipfian_distribution_input(n, 1000000)
+                                  : exponential_distribution_input(n, 1000);
+  SemisortStats stats;
+  SemisortConfig config;
+  config.scatter_engine = static_cast<ScatterEngine>(state.range(1));
+  config.stats = &stats;
+  auto out = in;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_with_hash(out, config);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+  REPORT_SEMISORT_STATS(stats);
+}
+
+//
+// Validate SMALL_SEQUENTIAL_MAX and SMALL_SORT_MAX: semisort n uniform keys in
+// a reused workspace through the sampling path (0) or the fast paths (1)
+//
+template<typename T>
+static void bench_semisort_small_inputs(benchmark::State& state) {
+  size_t n = state.range(0);
+  SemisortConfig config;
+  config.fast_paths = state.range(1);
+  auto in = uniform_distribution_input(n, n);
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+
+  while (state.KeepRunningBatch(100)) {
+    for (int i = 0; i < 100; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_without_alloc(out, ws, config);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+}
+
+//
+// Validate FEW_KEYS_MAX: semisort 10M records over few distinct keys through
+// the sampling path (0) or the per key counting scatter (1)
+//
+template<typename T>
+static void bench_semisort_few_keys(benchmark::State& state) {
+  size_t n = 10000000;
+  SemisortConfig config;
+  config.fast_paths = state.range(1);
+  auto in = uniform_distribution_input(n, state.range(0) - 1);
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_without_alloc(out, ws, config);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+}
+
+//
+// Cost of keeping groups in input order on uniform (0), zipfian (1) and
+// exponential (2) keys: unstable semisort (0), SemisortConfig::stable (1), and
+// unstable semisort followed by sorting every group by input position (2)
+//
+template<typename T>
+static void bench_semisort_stable(benchmark::State& state) {
+  size_t n = 10000000;
+  auto in = (state.range(0) == 0) ? uniform_distribution_input(n, n)
+          : (state.range(0) == 1) ? zipfian_distribution_input(n, 1000000)
+                                  : exponential_distribution_input(n, 1000);
+  parallel_for(0, n, [&](size_t i) { in[i].obj = i; });
+  SemisortConfig config;
+  config.stable = state.range(1) == 1;
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
 
   while (state.KeepRunningBatch(10)) {
     for (int i = 0; i < 10; i++) {
       COPY_NO_TIME(out, in);
-      semi_sort(out); // here does not check for correctness
+      semi_sort_without_alloc(out, ws, config);
+      if (state.range(1) == 2) {
+        auto group_starts = parlay::pack_index(parlay::delayed_seq<bool>(n, [&](size_t j) {
+          return j == 0 || out[j].hashed_key != out[j - 1].hashed_key;
+        }));
+        parallel_for(0, group_starts.size(), [&](size_t g) {
+          size_t end = (g + 1 < group_starts.size()) ? group_starts[g + 1] : n;
+          std::sort(out.begin() + group_starts[g], out.begin() + end, [](const auto &a, const auto &b) { return a.obj < b.obj; });
+        });
+      }
     }
   }
 
   REPORT_STATS(n, 0, 0);
 }
 
+//
+// Heavy key detection on uniform (0), zipfian (1) and exponential (2) keys:
+// the sorted sample (0) against per block Misra-Gries sketches over every
+// record (1), see HeavyDetection
+//
+template<typename T>
+static void bench_semisort_heavy_detection(benchmark::State& state) {
+  size_t n = 10000000;
+  auto in = (state.range(0) == 0) ? uniform_distribution_input(n, n)
+          : (state.range(0) == 1) ? zipfian_distribution_input(n, 1000000)
+                                  : exponential_distribution_input(n, 1000);
+  SemisortConfig config;
+  config.heavy_detection = static_cast<HeavyDetection>(state.range(1));
+  SemisortFootprint footprint;
+  auto out = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+
+  while (state.KeepRunningBatch(10)) {
+    for (int i = 0; i < 10; i++) {
+      COPY_NO_TIME(out, in);
+      semi_sort_without_alloc(out, ws, config, &footprint);
+    }
+  }
+
+  REPORT_STATS(n, 0, 0);
+  REPORT_FOOTPRINT(footprint);
+  state.counters["      Heavy keys"] = Counter(ws.num_heavy_buckets);
+}
+
 // See various input distributions
 template<typename T>
 static void bench_semi_sort(benchmark::State& state) {
@@ -319,4 +783,139 @@ BENCH(semisort_figure1_c, size_t, 100000000);
 
 // Figure 2
 BENCH(semisort_figure2_a, size_t);
-BENCH(semisort_figure2_a, size_t);
\ No newline at end of file
+BENCH(semisort_figure2_a, size_t);
+
+// NUMA placement of the bucket array on the figure 2 workloads
+BENCH(semisort_numa, size_t, 0, 0);
+BENCH(semisort_numa, size_t, 0, 1);
+BENCH(semisort_numa, size_t, 0, 2);
+BENCH(semisort_numa, size_t, 1, 0);
+BENCH(semisort_numa, size_t, 1, 1);
+BENCH(semisort_numa, size_t, 1, 2);
+
+// Workspace reuse
+BENCH(semisort_workspace, size_t, 100000);
+BENCH(semisort_workspace, size_t, 1000000);
+
+// Aggregation
+BENCH(semisort_group_then_reduce, size_t, 1000);
+BENCH(semisort_group_then_reduce, size_t, 1000000);
+BENCH(semisort_reduce_by_key, size_t, 1000);
+BENCH(semisort_reduce_by_key, size_t, 1000000);
+
+// Fused vs two-pass scatter
+BENCH(semisort_scatter_passes, size_t, 100000, 0);
+BENCH(semisort_scatter_passes, size_t, 100000, 1);
+BENCH(semisort_scatter_passes, size_t, 100000000, 0);
+BENCH(semisort_scatter_passes, size_t, 100000000, 1);
+
+// RandomCas vs CountingPlace scatter
+BENCH(semisort_scatter_engine, size_t, 0, 10000000, 0);
+BENCH(semisort_scatter_engine, size_t, 0, 10000000, 1);
+BENCH(semisort_scatter_engine, size_t, 1, 1000, 0);
+BENCH(semisort_scatter_engine, size_t, 1, 1000, 1);
+BENCH(semisort_scatter_engine, size_t, 1, 1000000, 0);
+BENCH(semisort_scatter_engine, size_t, 1, 1000000, 1);
+BENCH(semisort_scatter_engine, size_t, 0, 10000000, 2);
+BENCH(semisort_scatter_engine, size_t, 1, 1000, 2);
+BENCH(semisort_scatter_engine, size_t, 1, 1000000, 2);
+BENCH(semisort_scatter_engine, size_t, 2, 1000, 0);
+BENCH(semisort_scatter_engine, size_t, 2, 1000, 2);
+BENCH(semisort_scatter_engine, size_t, 0, 10000000, 3);
+BENCH(semisort_scatter_engine, size_t, 1, 1000, 3);
+BENCH(semisort_scatter_engine, size_t, 1, 1000000, 3);
+BENCH(semisort_scatter_engine, size_t, 2, 1000, 3);
+
+// In place vs by index for growing payloads
+BENCH(semisort_payload, Payload<8>, 0);
+BENCH(semisort_payload, Payload<8>, 1);
+BENCH(semisort_payload, Payload<32>, 0);
+BENCH(semisort_payload, Payload<32>, 1);
+BENCH(semisort_payload, Payload<64>, 0);
+BENCH(semisort_payload, Payload<64>, 1);
+BENCH(semisort_payload, Payload<128>, 0);
+BENCH(semisort_payload, Payload<128>, 1);
+BENCH(semisort_payload, Payload<256>, 0);
+BENCH(semisort_payload, Payload<256>, 1);
+
+// Permutation only, no records moved
+BENCH(semisort_indices, uint64_t, 1000000);
+BENCH(semisort_indices, uint64_t, 10000000);
+
+// Hash kernels
+BENCH(hash_keys, uint64_t, 10000000, 0);
+BENCH(hash_keys, uint64_t, 10000000, 1);
+BENCH(hash_keys, uint64_t, 10000000, 2);
+
+// String keys, arena vs interning
+BENCH(semisort_string_keys, size_t, 1000, 0);
+BENCH(semisort_string_keys, size_t, 1000, 1);
+BENCH(semisort_string_keys, size_t, 1000000, 0);
+BENCH(semisort_string_keys, size_t, 1000000, 1);
+
+// Exact grouping and narrower hashed keys
+BENCH(semisort_exact_keys, size_t, 1000000, 0, 0);
+BENCH(semisort_exact_keys, size_t, 1000000, 1, 0);
+BENCH(semisort_exact_keys, size_t, 1000000, 1, 32);
+BENCH(semisort_exact_keys, size_t, 1000000, 1, 24);
+
+// Out of core semisort
+BENCH(semisort_external, size_t, 10000000, 0, 64);
+BENCH(semisort_external, size_t, 100000000, 0, 256);
+BENCH(semisort_external, size_t, 100000000, 1, 256);
+
+// Multi-process sharding
+BENCH(semisort_sharded, size_t, 0, 1);
+BENCH(semisort_sharded, size_t, 0, 2);
+BENCH(semisort_sharded, size_t, 0, 4);
+BENCH(semisort_sharded, size_t, 0, 8);
+BENCH(semisort_sharded, size_t, 0, 16);
+BENCH(semisort_sharded, size_t, 1, 1);
+BENCH(semisort_sharded, size_t, 1, 16);
+
+// Phase breakdown
+BENCH(semisort_phases, size_t, 0, 0);
+BENCH(semisort_phases, size_t, 0, 2);
+BENCH(semisort_phases, size_t, 1, 0);
+BENCH(semisort_phases, size_t, 1, 2);
+BENCH(semisort_phases, size_t, 2, 0);
+BENCH(semisort_phases, size_t, 2, 1);
+
+// Small input and few key crossovers
+BENCH(semisort_small_inputs, size_t, 1000, 0);
+BENCH(semisort_small_inputs, size_t, 1000, 1);
+BENCH(semisort_small_inputs, size_t, 4000, 0);
+BENCH(semisort_small_inputs, size_t, 4000, 1);
+BENCH(semisort_small_inputs, size_t, 16000, 0);
+BENCH(semisort_small_inputs, size_t, 16000, 1);
+BENCH(semisort_small_inputs, size_t, 32000, 0);
+BENCH(semisort_small_inputs, size_t, 32000, 1);
+BENCH(semisort_small_inputs, size_t, 100000, 0);
+BENCH(semisort_small_inputs, size_t, 100000, 1);
+BENCH(semisort_few_keys, size_t, 4, 0);
+BENCH(semisort_few_keys, size_t, 4, 1);
+BENCH(semisort_few_keys, size_t, 16, 0);
+BENCH(semisort_few_keys, size_t, 16, 1);
+BENCH(semisort_few_keys, size_t, 64, 0);
+BENCH(semisort_few_keys, size_t, 64, 1);
+BENCH(semisort_few_keys, size_t, 256, 0);
+BENCH(semisort_few_keys, size_t, 256, 1);
+
+// Stable groups
+BENCH(semisort_stable, size_t, 0, 0);
+BENCH(semisort_stable, size_t, 0, 1);
+BENCH(semisort_stable, size_t, 0, 2);
+BENCH(semisort_stable, size_t, 1, 0);
+BENCH(semisort_stable, size_t, 1, 1);
+BENCH(semisort_stable, size_t, 1, 2);
+BENCH(semisort_stable, size_t, 2, 0);
+BENCH(semisort_stable, size_t, 2, 1);
+BENCH(semisort_stable, size_t, 2, 2);
+
+// Heavy key detection
+BENCH(semisort_heavy_detection, size_t, 0, 0);
+BENCH(semisort_heavy_detection, size_t, 0, 1);
+BENCH(semisort_heavy_detection, size_t, 1, 0);
+BENCH(semisort_heavy_detection, size_t, 1, 1);
+BENCH(semisort_heavy_detection, size_t, 2, 0);
+BENCH(semisort_heavy_detection, size_t, 2, 1);
@@ -0,0 +1,81 @@
+#pragma once
+// Key distributions shared by the benchmarks and the tuning harness
+
+#include <parlay/primitives.h>
+#include <parlay/random.h>
+
+#include <random>
+
+#include "../src/semisort_header.h"
+#include "genzipf.cpp"
+
+//
+// Return uniform_distributions input, note that the records are already hashed
+//
+static parlay::sequence<record<uint64_t, uint64_t>> uniform_distribution_input(size_t n, size_t para) {
+  
+  parlay::random_generator generator;
+  std::uniform_int_distribution<uint64_t> distribution(0, para);
+  uint64_t k = hash_range(n);
+
+  parlay::sequence<record<uint64_t, uint64_t>> arr(n);
+  parallel_for(0, n, [&](size_t i) {
+    auto r = generator[i];
+    uint64_t key = distribution(r);
+    record<uint64_t, uint64_t> elt = {
+      0,
+      key,
+      parlay::hash64(key) % k + 1
+    };
+    arr[i] = elt;
+  });
+
+  return arr;
+}
+
+//
+// Return exponential_distribution input, note that the records are already hashed
+//
+static parlay::sequence<record<uint64_t, uint64_t>> exponential_distribution_input(size_t n, size_t para) {
+  
+  parlay::random_generator generator;
+  std::exponential_distribution<double> distribution(para);
+  uint64_t k = hash_range(n);
+
+  parlay::sequence<record<uint64_t, uint64_t>> arr(n);
+  parallel_for(0, n, [&](size_t i) {
+    auto r = generator[i];
+    uint64_t key = static_cast<uint64_t>(n * distribution(r));
+    record<uint64_t, uint64_t> elt = {
+      0,
+      key,
+      parlay::hash64(key) % k + 1
+    };
+    arr[i] = elt;
+  });
+
+  return arr;
+}
+
+//
+// Return zipfian_distribution input, note that the records are already hashed
+//
+static parlay::sequence<record<uint64_t, uint64_t>> zipfian_distribution_input(size_t n, size_t para) {
+  
+  rand_val(1);
+  uint64_t k = hash_range(n);
+  uint64_t key;
+
+  parlay::sequence<record<uint64_t, uint64_t>> arr(n);
+  for (size_t i = 0; i < n; i++) { // zipf keeps global state, so this stays sequential
+    key = static_cast<uint64_t>(zipf(1.0, para)); // according to section 5.1: "the i-th number in this range has a probability 1/(iM-) of being chosen..."
+    record<uint64_t, uint64_t> elt = {
+      0,
+      key,
+      parlay::hash64(key) % k + 1
+    };
+    arr[i] = elt;
+  }
+
+  return arr;
+}
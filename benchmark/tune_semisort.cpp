@@ -0,0 +1,207 @@
+// Tune the sampling and bucketing constants of semisort to this machine
+//
+//   tune_semisort [n] [worker counts...] > semisort.profile
+//
+// The benchmark distributions are grouped by the SampleShape of their sample,
+// and the constants of every group are found by coordinate descent over the
+// grids below, timing semi_sort_without_alloc on n records. The sample is
+// drawn before its shape is known, so one sample constant is then chosen for
+// all groups and the other constants are tuned again around it. Every worker
+// count runs in a child process started with PARLAY_NUM_THREADS; without any,
+// the workers of this process are tuned. Load the output with
+// SemisortProfile::read and pass it as SemisortConfig::profile.
+
+#include <parlay/parallel.h>
+#include <parlay/primitives.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+
+#include "semisort_inputs.h"
+
+using Record = record<uint64_t, uint64_t>;
+
+struct Workload {
+  const char *name;
+  parlay::sequence<Record> input;
+  SampleShape shape;
+};
+
+// values tried for each constant, in SemisortTuning order
+static const parlay::sequence<float> GRIDS[] = {
+  {2, 3, 5, 8},
+  {1, 2, 4},
+  {1, 1.25, 1.5, 2},
+  {1, 2, 4},
+};
+static float SemisortTuning::*const FIELDS[] = {
+  &SemisortTuning::sample_probability_constant,
+  &SemisortTuning::delta_threshold,
+  &SemisortTuning::f_c,
+  &SemisortTuning::light_key_bucket_constant,
+};
+static const int ROUNDS = 3;
+
+static SemisortProfile single_entry_profile(const SemisortTuning &tuning) {
+  SemisortProfile profile;
+  profile.entries.push_back({0, SampleShape::Any, tuning});
+  return profile;
+}
+
+// tuning as semi_sort would run it, after clamping
+static SemisortTuning clamped(const SemisortTuning &tuning) {
+  SemisortProfile profile = single_entry_profile(tuning);
+  SemisortConfig config;
+  config.profile = &profile;
+  return semisort_tuning(config, SampleShape::Any);
+}
+
+static bool same_tuning(const SemisortTuning &a, const SemisortTuning &b) {
+  for (auto field : FIELDS)
+    if (a.*field != b.*field)
+      return false;
+  return true;
+}
+
+// shape of a sample of the input drawn with the default constants, sized as
+// build_buckets sizes it: at least one record however small the input
+static SampleShape input_shape(const parlay::sequence<Record> &in) {
+  size_t n = in.size();
+  if (n == 0)
+    return SampleShape::Any;
+  double p = std::min(SAMPLE_PROBABILITY_CONSTANT / log2((double)std::max(n, (size_t)2)), 0.25);
+  size_t num_samples = (size_t)std::max(floor(n * p) - 1, 1.0);
+  size_t stride = n / num_samples;
+  auto sample = parlay::tabulate(num_samples, [&](size_t i) { return in[i * stride]; });
+  parlay::sort_inplace(sample, [](const Record &a, const Record &b) { return a.hashed_key < b.hashed_key; });
+  return classify_sample(sample, num_samples, n);
+}
+
+// summed fastest semisort time of every workload in group under tuning
+static double time_group(const parlay::sequence<Workload *> &group, const SemisortTuning &tuning) {
+  SemisortProfile profile = single_entry_profile(tuning);
+  SemisortConfig config;
+  config.profile = &profile;
+  double total = 0;
+  for (Workload *workload : group) {
+    SemisortWorkspace<uint64_t, uint64_t> ws;
+    double best = std::numeric_limits<double>::max();
+    for (int r = 0; r < ROUNDS; r++) {
+      auto out = workload->input;
+      auto start = std::chrono::steady_clock::now();
+      semi_sort_without_alloc(out, ws, config);
+      best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    total += best;
+  }
+  return total;
+}
+
+// two rounds of coordinate descent from start over the fields from first_field on
+static SemisortTuning descend(const parlay::sequence<Workload *> &group, SemisortTuning start, size_t first_field) {
+  SemisortTuning best = start;
+  double best_time = time_group(group, best);
+  for (int round = 0; round < 2; round++) {
+    for (size_t f = first_field; f < 4; f++) {
+      for (float value : GRIDS[f]) {
+        SemisortTuning candidate = best;
+        candidate.*FIELDS[f] = value;
+        if (same_tuning(candidate, best) || !same_tuning(clamped(candidate), candidate))
+          continue;
+        double time = time_group(group, candidate);
+        if (time < best_time) {
+          best = candidate;
+          best_time = time;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+// profile lines for the workers of this process
+static SemisortProfile tune(size_t n) {
+  size_t workers = parlay::num_workers();
+  fprintf(stderr, "tuning %zu workers on %zu records\n", workers, n);
+  parlay::sequence<Workload> workloads;
+  workloads.push_back({"uniform", uniform_distribution_input(n, n), SampleShape::Any});
+  workloads.push_back({"uniform n/100", uniform_distribution_input(n, n / 100), SampleShape::Any});
+  workloads.push_back({"zipfian", zipfian_distribution_input(n, 1000000), SampleShape::Any});
+  workloads.push_back({"exponential", exponential_distribution_input(n, 1000), SampleShape::Any});
+
+  parlay::sequence<parlay::sequence<Workload *>> groups(NUM_SAMPLE_SHAPES);
+  for (Workload &workload : workloads) {
+    workload.shape = input_shape(workload.input);
+    groups[(int)workload.shape].push_back(&workload);
+    fprintf(stderr, "  %s: %s\n", workload.name, SAMPLE_SHAPE_NAMES[(int)workload.shape]);
+  }
+
+  SemisortTuning defaults = {SAMPLE_PROBABILITY_CONSTANT, DELTA_THRESHOLD, F_C, LIGHT_KEY_BUCKET_CONSTANT};
+  parlay::sequence<SemisortTuning> tuned(NUM_SAMPLE_SHAPES, defaults);
+  for (size_t s = 0; s < NUM_SAMPLE_SHAPES; s++)
+    if (!groups[s].empty())
+      tuned[s] = descend(groups[s], defaults, 0);
+
+  // the sample constant every group shares
+  float sample_constant = SAMPLE_PROBABILITY_CONSTANT;
+  double best_time = std::numeric_limits<double>::max();
+  for (float value : GRIDS[0]) {
+    double time = 0;
+    for (size_t s = 0; s < NUM_SAMPLE_SHAPES; s++) {
+      if (groups[s].empty())
+        continue;
+      SemisortTuning candidate = tuned[s];
+      candidate.sample_probability_constant = value;
+      time += time_group(groups[s], clamped(candidate));
+    }
+    if (time < best_time) {
+      sample_constant = value;
+      best_time = time;
+    }
+  }
+
+  SemisortProfile profile;
+  SemisortTuning any = defaults;
+  any.sample_probability_constant = sample_constant;
+  profile.entries.push_back({workers, SampleShape::Any, clamped(any)});
+  for (size_t s = 0; s < NUM_SAMPLE_SHAPES; s++) {
+    if (groups[s].empty())
+      continue;
+    SemisortTuning start = tuned[s];
+    start.sample_probability_constant = sample_constant;
+    profile.entries.push_back({workers, (SampleShape)s, descend(groups[s], clamped(start), 1)});
+  }
+  return profile;
+}
+
+int main(int argc, char **argv) {
+  size_t n = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 10000000;
+  if (getenv("TUNE_SEMISORT_CHILD") != nullptr || argc <= 2) {
+    tune(n).write(stdout);
+    return 0;
+  }
+
+  // one child per worker count; only the first child's header comment is kept
+  setenv("TUNE_SEMISORT_CHILD", "1", 1);
+  for (int i = 2; i < argc; i++) {
+    setenv("PARLAY_NUM_THREADS", argv[i], 1);
+    std::string command = std::string(argv[0]) + " " + std::to_string(n);
+    FILE *child = popen(command.c_str(), "r");
+    if (child == nullptr) {
+      fprintf(stderr, "cannot run %s\n", command.c_str());
+      return 1;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), child) != nullptr)
+      if (i == 2 || line[0] != '#')
+        fputs(line, stdout);
+    if (pclose(child) != 0) {
+      fprintf(stderr, "tuning %s workers failed\n", argv[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -1,80 +1,76 @@
 #include "semisort_header.h"
-#include <fstream>
-
-// runs a small test case
-int main() {
-    uint32_t ex_size = 1000;
-    parlay::sequence<record<string, uint64_t>> int_keys(ex_size);
-    for(int i = 0; i < ex_size; i++){
-        record<string, uint64_t> a = {
-            "object_" + to_string(i),
-            static_cast<unsigned long long>(i % 5 + 1),
-            static_cast<unsigned long long>(i % 5 + 1)
-        };
-        int_keys[i] = a;
+#include "semisort_io.h"
+
+#include <chrono>
+#include <cstring>
+
+// Semisort a key file and optionally write the grouped result:
+//   semisort <input> [keys|pairs|text] [output]
+// keys and pairs are binary uint64_t files (see InputFormat), text is one key
+// per line. Load, sort and write are timed separately; built with
+// SEMISORT_STATS the per phase stats of the sort are printed as JSON too.
+// SEMISORT_PROFILE names a profile written by benchmark/tune_semisort to sort with.
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        cerr << "usage: " << argv[0] << " <input> [keys|pairs|text] [output]" << endl;
+        return 1;
     }
-
-    // auto rng = default_random_engine {};
-    // shuffle(int_keys.begin(), int_keys.end(), rng);
-
-    // std::ifstream inputFile("/Users/zhiweigan/Desktop/Spring 2022/6.827/parallel-semisort/src/test/zipfDistSeq_10000_100000000");
-    // std::ifstream inputFile("/Users/zhiweigan/Desktop/Spring 2022/6.827/parallel-semisort/src/test/expDistSeq_10000_100");
-
-    // long k = pow(ex_size, HASH_RANGE_K);
-    // std::string myline;
-    // int i = 0;
-    // if (inputFile.is_open())
-    // {
-    //     std::getline(inputFile, myline);
-    //     while (inputFile)
-    //     {
-    //         std::getline(inputFile, myline);
-
-    //         try {
-    //             // cout<<stoull(myline)<<endl;
-    //             record<string, uint64_t> a = {
-    //                 "object_" + to_string(i),
-    //                 stoull(myline) % k + 1,
-    //                 stoull(myline) % k + 1,
-    //             };
-
-    //             int_keys[i] = a;
-    //             i++;
-    //         } catch (const std::exception& e) {
-
-    //         }
-    //     }
-    // }
-    // cout<<i<<endl;
-
-
-    semi_sort(int_keys);
-
-    cout<<"finished"<<endl;
-
-    for (uint32_t i = 0; i < ex_size; i++) {
-        cout << i << " " << int_keys[i].obj << " " << int_keys[i].key << " " << int_keys[i].hashed_key << endl;
+    const char *format_name = (argc > 2) ? argv[2] : "keys";
+    InputFormat format;
+    if (strcmp(format_name, "keys") == 0) {
+        format = InputFormat::BinaryKeys;
+    } else if (strcmp(format_name, "pairs") == 0) {
+        format = InputFormat::BinaryPairs;
+    } else if (strcmp(format_name, "text") == 0) {
+        format = InputFormat::TextKeys;
+    } else {
+        cerr << "unknown input format " << format_name << endl;
+        return 1;
     }
 
-    // parlay::sequence<record<string, uint8_t>> string_keys(ex_size);
-    // uint8_t keys[4] = {135, 236, 1, 10};
-    // for (uint32_t i = 0; i < ex_size; i++)
-    // {
-    //     record<string, uint8_t> a = {
-    //         "object_" + to_string(i),
-    //         keys[i % 4],
-    //         0};
-    //     string_keys[i] = a;
-    // }
-
-    // shuffle(string_keys.begin(), string_keys.end(), rng);
-
-    // semi_sort_with_hash(string_keys);
-
-    // cout<<"finished"<<endl;
-
-    // for (uint32_t i = 0; i < ex_size; i++)
-    // {
-    //     cout << i << " " << string_keys[i].obj << " " << string_keys[i].key << " " << string_keys[i].hashed_key << endl;
-    // }
-}
\ No newline at end of file
+    using clock = chrono::steady_clock;
+    auto seconds_since = [](clock::time_point start) {
+        return chrono::duration<double>(clock::now() - start).count();
+    };
+    try {
+        auto start = clock::now();
+        auto records = load_records(argv[1], format);
+        double load_seconds = seconds_since(start);
+
+        start = clock::now();
+        SemisortStats stats;
+        SemisortConfig config;
+        config.stats = &stats;
+        SemisortProfile profile;
+        if (const char *profile_path = getenv("SEMISORT_PROFILE")) {
+            profile = SemisortProfile::read(profile_path);
+            config.profile = &profile;
+        }
+        if (!records.empty())
+            semi_sort_with_hash(records, config);
+        double sort_seconds = seconds_since(start);
+
+        double write_seconds = 0;
+        if (argc > 3) {
+            start = clock::now();
+            write_records(argv[3], records, format);
+            write_seconds = seconds_since(start);
+        }
+
+        size_t num_groups = parlay::count_if(parlay::iota(records.size()), [&](size_t i) {
+            return i == 0 || records[i].hashed_key != records[i - 1].hashed_key;
+        });
+        cout << "records " << records.size() << ", groups " << num_groups << endl;
+        cout << "load  " << load_seconds << " s" << endl;
+        cout << "sort  " << sort_seconds << " s" << endl;
+        if (argc > 3)
+            cout << "write " << write_seconds << " s" << endl;
+#ifdef SEMISORT_STATS
+        cout << "stats " << stats.to_json() << endl;
+#endif
+    } catch (const std::exception &e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
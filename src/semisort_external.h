@@ -0,0 +1,439 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+
+#include "semisort_header.h"
+
+// Settings for semi_sort_external
+struct ExternalSemisortConfig
+{
+    // used for every partition semisorted in memory
+    SemisortConfig semisort;
+    // memory for the in-memory stage: a partition, its bucket array (up to
+    // BUCKET_SPACE_FACTOR records per record), the next partition being read
+    // and the previous one being written
+    size_t memory_budget_bytes = 1ull << 30;
+    // largest spill buffer of a partition; every flush is one sequential write
+    // of a full buffer. The spill pass charges its num_partitions buffers to
+    // memory_budget_bytes, so with many partitions they come out smaller
+    size_t write_block_bytes = 1 << 20;
+    // run files the spill pass keeps open at once; past it the least recently
+    // flushed run is closed and reopened for append at its next flush
+    size_t max_open_runs = 256;
+    // every call spills into a fresh directory made here with mkdtemp
+    std::string spill_directory = "/tmp";
+};
+
+// What semi_sort_external moved and where its time went
+struct ExternalSemisortStats
+{
+    size_t n = 0;
+    size_t num_samples = 0;
+    size_t num_light_partitions = 0;
+    size_t num_heavy_partitions = 0;
+    size_t largest_partition = 0; // records, light partitions only
+    size_t bytes_read = 0;        // input twice, then every run file once
+    size_t bytes_written = 0;     // run files and output
+    double sample_seconds = 0;
+    double spill_seconds = 0;
+    double sort_seconds = 0;
+};
+
+inline FILE *open_external_file(const std::string &path, const char *mode)
+{
+    FILE *file = fopen(path.c_str(), mode);
+    if (file == nullptr)
+        throw std::runtime_error("semi_sort_external: cannot open " + path);
+    return file;
+}
+
+template <class T>
+inline void write_external_file(FILE *file, const T *data, size_t count)
+{
+    if (count > 0 && fwrite(data, sizeof(T), count, file) != count)
+        throw std::runtime_error("semi_sort_external: write failed");
+}
+
+// Call process(chunk) on consecutive chunks of up to chunk_records records of
+// file while the next chunk is read on another thread. Returns the bytes read.
+template <class Record, class Process>
+size_t for_each_external_chunk(FILE *file, size_t chunk_records, Process process)
+{
+    parlay::sequence<Record> current(chunk_records), next(chunk_records);
+    auto read_into = [file](parlay::sequence<Record> &chunk) {
+        size_t count = fread(chunk.data(), sizeof(Record), chunk.size(), file);
+        if (ferror(file))
+            throw std::runtime_error("semi_sort_external: read failed");
+        // only the last chunk comes up short
+        if (count < chunk.size())
+            chunk = parlay::sequence<Record>(chunk.begin(), chunk.begin() + count);
+        return count;
+    };
+
+    size_t total = read_into(current);
+    while (current.size() > 0) {
+        auto pending = std::async(std::launch::async, [&] { return read_into(next); });
+        process(current);
+        total += pending.get();
+        swap(current, next);
+    }
+    return total * sizeof(Record);
+}
+
+// Run files of the spill pass in directory, at most max_open of them open at
+// once. acquire opens a run unless it still is, first closing the least
+// recently acquired run no writer holds when the pool is full; more writers
+// than max_open at a time briefly go past it.
+class ExternalRunFiles
+{
+  public:
+    ExternalRunFiles(const std::string &directory, size_t num_runs, size_t max_open)
+        : directory(directory), files(num_runs, nullptr), last_use(num_runs, 0), held(num_runs, false),
+          created(num_runs, false), max_open(max(max_open, (size_t)1))
+    {
+    }
+
+    ~ExternalRunFiles() { close_all(); }
+
+    std::string path(size_t run) const { return directory + "/run_" + std::to_string(run); }
+
+    FILE *acquire(size_t run)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        held[run] = true;
+        last_use[run] = ++uses;
+        if (files[run] != nullptr)
+            return files[run];
+        if (open_runs.size() >= max_open) {
+            size_t victim = open_runs.size();
+            for (size_t i = 0; i < open_runs.size(); i++)
+                if (!held[open_runs[i]] && (victim == open_runs.size() || last_use[open_runs[i]] < last_use[open_runs[victim]]))
+                    victim = i;
+            if (victim < open_runs.size()) {
+                fclose(files[open_runs[victim]]);
+                files[open_runs[victim]] = nullptr;
+                open_runs[victim] = open_runs.back();
+                open_runs.pop_back();
+            }
+        }
+        files[run] = open_external_file(path(run), created[run] ? "ab" : "wb");
+        created[run] = true;
+        open_runs.push_back(run);
+        return files[run];
+    }
+
+    void release(size_t run)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        held[run] = false;
+    }
+
+    void close_all()
+    {
+        for (size_t run : open_runs)
+            fclose(files[run]);
+        for (size_t run : open_runs)
+            files[run] = nullptr;
+        open_runs.clear();
+    }
+
+  private:
+    std::string directory;
+    std::vector<FILE *> files;
+    std::vector<size_t> last_use;
+    std::vector<bool> held;
+    std::vector<bool> created;
+    std::vector<size_t> open_runs;
+    size_t max_open;
+    size_t uses = 0;
+    std::mutex lock;
+};
+
+// Semisort a binary file of record<Object, Key> that does not fit in memory into
+// output_path, hashing the keys as semi_sort_with_hash does (the input's
+// hashed_key fields are ignored). Three passes, each streaming the disk:
+//   1. sample every chunk of the input with get_sampled_elements and run
+//      get_bucket_sizes over the pooled sample: keys expected to fill a quarter
+//      of a partition become heavy partitions, the rest of the hashed key range
+//      is split into power of two light partitions like the light buckets
+//   2. route every record to its partition's run file in a fresh directory
+//      under spill_directory through per partition buffers, keeping at most
+//      max_open_runs run files open
+//   3. semisort each light run in memory and append it to the output while the
+//      next run is read and the previous one written; heavy runs hold a single
+//      hashed key and are copied through unsorted. With
+//      config.semisort.exact_keys a heavy run may still mix keys whose hashes
+//      collided: the records of its first key are streamed to the output and
+//      the rest to a leftover run, until what is left fits in a partition and
+//      is split in memory
+// Every group of the output lies inside one run. A light partition the sample
+// underestimated is still sorted whole, so memory_budget_bytes is a target.
+template <class Object, class Key>
+ExternalSemisortStats semi_sort_external(
+    const std::string &input_path,
+    const std::string &output_path,
+    const ExternalSemisortConfig &config = ExternalSemisortConfig())
+{
+    using Record = record<Object, Key>;
+    static_assert(std::is_trivially_copyable<Record>::value, "records are spilled as raw bytes");
+    using clock = std::chrono::steady_clock;
+    auto seconds_since = [](clock::time_point start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    ExternalSemisortStats stats;
+    hash<Key> hash_fn;
+    FILE *input = open_external_file(input_path, "rb");
+    fseeko(input, 0, SEEK_END);
+    size_t n = ftello(input) / sizeof(Record);
+    fseeko(input, 0, SEEK_SET);
+    stats.n = n;
+    if (n == 0) {
+        fclose(input);
+        fclose(open_external_file(output_path, "wb"));
+        return stats;
+    }
+
+    size_t partition_records = max((size_t)PARTITION_SORT_MIN,
+        (size_t)(config.memory_budget_bytes / (sizeof(Record) * (BUCKET_SPACE_FACTOR + 3))));
+    uint32_t bits = hashed_key_bits(n, config.semisort);
+    uint64_t multiplier = hash_multiplier(with_hash_multiplier(config.semisort));
+    auto hash_records = [&](parlay::sequence<Record> &records, uint32_t hash_bits) {
+        hash_keys(
+            records.size(), hash_bits,
+            [&](size_t i) { return hashable_key(records[i].key, hash_fn); },
+            [&](size_t i, uint64_t hashed_key) { records[i].hashed_key = hashed_key; }, multiplier);
+    };
+
+    // Pass 1: a stratified sample of every chunk, at most one partition of records
+    auto start = clock::now();
+    double logn = log2((double)n);
+    double p = min({SAMPLE_PROBABILITY_CONSTANT / logn, 0.25, (double)partition_records / n});
+    SemisortWorkspace<Object, Key, uint64_t> sample_ws;
+    parlay::sequence<Record> sample;
+    parlay::sequence<Record> chunk_sample;
+    size_t chunk_index = 0;
+    stats.bytes_read += for_each_external_chunk<Record>(input, partition_records, [&](parlay::sequence<Record> &chunk) {
+        size_t count = chunk.size();
+        size_t num_samples = min(count, max((size_t)1, (size_t)(count * p)));
+        hash_records(chunk, bits);
+        ensure_capacity(sample_ws.int_scrap, count);
+        ensure_capacity(chunk_sample, num_samples);
+        std::uniform_int_distribution<size_t> dis(0, count - 1);
+        get_sampled_elements(chunk, sample_ws.int_scrap, chunk_sample, num_samples, count,
+                             parlay::random_generator(chunk_index++), dis);
+        sample.append(chunk_sample.begin(), chunk_sample.begin() + num_samples);
+    });
+    size_t num_samples = sample.size();
+    parlay::internal::integer_sort_inplace(make_slice(sample), [](Record r) { return r.hashed_key; }, 0);
+    ensure_capacity(sample_ws.record_scrap, num_samples);
+    parallel_for(0, num_samples, [&](size_t i) {
+        sample_ws.record_scrap[i] = sample[i];
+    });
+
+    // light partitions are filled to half the budget to absorb sampling error;
+    // get_bucket_sizes calls a key heavy past gamma = threshold * ln n samples
+    size_t light_target = max((size_t)1, partition_records / 2);
+    uint32_t log_num_light = 0;
+    while (log_num_light < bits && (n >> log_num_light) > light_target)
+        log_num_light++;
+    size_t num_light = 1ull << log_num_light;
+    uint32_t partition_shift = bits - log_num_light;
+    double heavy_samples = max(DELTA_THRESHOLD * log((double)n), p * light_target / 4);
+    get_bucket_sizes(sample_ws, num_samples, num_light, partition_shift, n,
+                     (float)(heavy_samples / log((double)n)), (float)p, F_C);
+    size_t num_heavy = sample_ws.num_heavy_buckets;
+    sample_ws.heavy_table.build(sample_ws.heavy_key_buckets, num_heavy);
+    const auto &heavy_table = sample_ws.heavy_table;
+    stats.num_samples = num_samples;
+    stats.num_light_partitions = num_light;
+    stats.num_heavy_partitions = num_heavy;
+    stats.sample_seconds = seconds_since(start);
+
+    // light partitions first, then one per heavy key
+    size_t num_partitions = num_light + num_heavy;
+    auto partition_of = [&](uint64_t hashed_key) -> size_t {
+        uint32_t heavy;
+        if (heavy_table.find_index(hashed_key, heavy))
+            return num_light + heavy;
+        return light_bucket_index(hashed_key, partition_shift, num_light);
+    };
+    std::string spill_path = config.spill_directory + "/semisort_XXXXXX";
+    if (mkdtemp(&spill_path[0]) == nullptr)
+        throw std::runtime_error("semi_sort_external: cannot create a spill directory in " + config.spill_directory);
+    ExternalRunFiles runs(spill_path, num_partitions, config.max_open_runs);
+
+    // the spill buffers share what the budget leaves beside the chunk being
+    // routed and the next one being read
+    size_t chunk_bytes = 2 * partition_records * sizeof(Record);
+    size_t spill_bytes = config.memory_budget_bytes > chunk_bytes ? config.memory_budget_bytes - chunk_bytes : 0;
+    size_t write_block_records = max((size_t)1,
+        min(config.write_block_bytes, spill_bytes / num_partitions) / sizeof(Record));
+
+    // Pass 2: group each chunk by partition and append the runs to the spill
+    // buffers
+    start = clock::now();
+    parlay::sequence<std::vector<Record>> spill_buffers(num_partitions);
+    parlay::sequence<size_t> run_sizes(num_partitions, 0);
+    parlay::sequence<size_t> run_bytes_written(num_partitions, 0);
+    auto flush = [&](size_t partition, const Record *extra, size_t extra_count) {
+        auto &buffer = spill_buffers[partition];
+        FILE *run = runs.acquire(partition);
+        write_external_file(run, buffer.data(), buffer.size());
+        write_external_file(run, extra, extra_count);
+        runs.release(partition);
+        run_bytes_written[partition] += (buffer.size() + extra_count) * sizeof(Record);
+        buffer.clear();
+    };
+    fseeko(input, 0, SEEK_SET);
+    stats.bytes_read += for_each_external_chunk<Record>(input, partition_records, [&](parlay::sequence<Record> &chunk) {
+        size_t count = chunk.size();
+        hash_records(chunk, bits);
+        parlay::internal::integer_sort_inplace(make_slice(chunk), [&](Record r) { return partition_of(r.hashed_key); }, 0);
+        auto run_starts = parlay::pack_index(parlay::delayed_seq<bool>(count, [&](size_t i) {
+            return i == 0 || partition_of(chunk[i].hashed_key) != partition_of(chunk[i - 1].hashed_key);
+        }));
+        // runs of one chunk go to distinct partitions, so each buffer and run
+        // file has a single writer
+        parallel_for(0, run_starts.size(), [&](size_t r) {
+            size_t run_start = run_starts[r];
+            size_t run_end = (r + 1 == run_starts.size()) ? count : run_starts[r + 1];
+            size_t partition = partition_of(chunk[run_start].hashed_key);
+            auto &buffer = spill_buffers[partition];
+            run_sizes[partition] += run_end - run_start;
+            if (buffer.size() + (run_end - run_start) >= write_block_records) {
+                flush(partition, chunk.data() + run_start, run_end - run_start);
+            } else {
+                if (buffer.capacity() == 0)
+                    buffer.reserve(write_block_records);
+                buffer.insert(buffer.end(), chunk.begin() + run_start, chunk.begin() + run_end);
+            }
+        }, 1);
+    });
+    parallel_for(0, num_partitions, [&](size_t partition) {
+        if (!spill_buffers[partition].empty())
+            flush(partition, nullptr, 0);
+        spill_buffers[partition] = std::vector<Record>();
+    }, 1);
+    runs.close_all();
+    fclose(input);
+    stats.bytes_written += parlay::reduce(run_bytes_written);
+    stats.spill_seconds = seconds_since(start);
+
+    // Pass 3: semisort and emit every light run, copy every heavy run
+    start = clock::now();
+    FILE *output = open_external_file(output_path, "wb");
+    SemisortIndexWorkspace<Object, Key, uint32_t> ws;
+    SemisortIndexWorkspace<Object, Key, uint64_t> wide_ws;
+    auto load_run = [&](const std::string &path, size_t count) {
+        parlay::sequence<Record> records(count);
+        FILE *run = open_external_file(path, "rb");
+        if (fread(records.data(), sizeof(Record), records.size(), run) != records.size())
+            throw std::runtime_error("semi_sort_external: short run file " + path);
+        fclose(run);
+        remove(path.c_str());
+        return records;
+    };
+    // a run's hashed keys share their top bits, see semi_sort_rehashed
+    auto sort_run = [&](parlay::sequence<Record> &records) {
+        if (index_width_fits<uint32_t>(records.size()))
+            semi_sort_rehashed(records, ws, config.semisort);
+        else
+            semi_sort_rehashed(records, wide_ws, config.semisort);
+    };
+    // stream a heavy run to the output; with exact keys every round moves the
+    // records of one key and leaves the rest in the next round's run
+    auto emit_heavy_run = [&](size_t partition) {
+        std::string path = runs.path(partition);
+        size_t count = run_sizes[partition];
+        parlay::sequence<Record> block(write_block_records);
+        parlay::sequence<Record> rest_block(config.semisort.exact_keys ? write_block_records : 0);
+        for (size_t round = 1; config.semisort.exact_keys && count > partition_records; round++) {
+            std::string rest_path = runs.path(partition) + "." + std::to_string(round);
+            FILE *run = open_external_file(path, "rb");
+            FILE *rest = open_external_file(rest_path, "wb");
+            Key key = Key();
+            size_t rest_count = 0;
+            size_t read;
+            for (bool first = true; (read = fread(block.data(), sizeof(Record), block.size(), run)) > 0; first = false) {
+                if (first)
+                    key = block[0].key;
+                size_t kept = 0;
+                size_t moved = 0;
+                for (size_t i = 0; i < read; i++) {
+                    if (block[i].key == key)
+                        block[kept++] = block[i];
+                    else
+                        rest_block[moved++] = block[i];
+                }
+                write_external_file(output, block.data(), kept);
+                write_external_file(rest, rest_block.data(), moved);
+                rest_count += moved;
+            }
+            fclose(run);
+            fclose(rest);
+            remove(path.c_str());
+            stats.bytes_read += count * sizeof(Record);
+            stats.bytes_written += (count + rest_count) * sizeof(Record);
+            path = rest_path;
+            count = rest_count;
+        }
+        if (config.semisort.exact_keys) {
+            auto records = load_run(path, count);
+            split_collided_records(records);
+            write_external_file(output, records.data(), records.size());
+        } else {
+            FILE *run = open_external_file(path, "rb");
+            size_t read;
+            while ((read = fread(block.data(), sizeof(Record), block.size(), run)) > 0)
+                write_external_file(output, block.data(), read);
+            fclose(run);
+            remove(path.c_str());
+        }
+        stats.bytes_read += count * sizeof(Record);
+        stats.bytes_written += count * sizeof(Record);
+    };
+
+    std::future<void> pending_write;
+    std::future<parlay::sequence<Record>> pending_load;
+    auto wait_for_write = [&] {
+        if (pending_write.valid())
+            pending_write.get();
+    };
+    for (size_t partition = 0; partition < num_partitions; partition++) {
+        if (run_sizes[partition] == 0)
+            continue;
+        if (partition >= num_light) {
+            wait_for_write();
+            emit_heavy_run(partition);
+            continue;
+        }
+
+        auto records = pending_load.valid() ? pending_load.get() : load_run(runs.path(partition), run_sizes[partition]);
+        size_t next = partition + 1;
+        while (next < num_light && run_sizes[next] == 0)
+            next++;
+        if (next < num_light)
+            pending_load = std::async(std::launch::async, load_run, runs.path(next), run_sizes[next]);
+        stats.bytes_read += records.size() * sizeof(Record);
+        stats.largest_partition = max(stats.largest_partition, records.size());
+        sort_run(records);
+        wait_for_write();
+        stats.bytes_written += records.size() * sizeof(Record);
+        pending_write = std::async(std::launch::async, [output, records = std::move(records)] {
+            write_external_file(output, records.data(), records.size());
+        });
+    }
+    wait_for_write();
+    fclose(output);
+    rmdir(spill_path.c_str());
+    stats.sort_seconds = seconds_since(start);
+    return stats;
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include "semisort_header.h"
+
+// ----------------------- DECLARATION -------------------------
+// A group is the key shared by its records and the slice of the semisorted
+// sequence holding them. Like semi_sort, groups are formed by hashed_key, and
+// with config.exact_keys by the keys themselves.
+template <class Object, class Key>
+using record_slice = decltype(std::declval<parlay::sequence<record<Object, Key>> &>().cut(0, 0));
+
+template <class Object, class Key>
+using record_group = std::pair<Key, record_slice<Object, Key>>;
+
+// Semisort arr in place and return one (key, slice of arr) per group
+template <class Object, class Key>
+parlay::sequence<record_group<Object, Key>> semisort_group_by(
+    parlay::sequence<record<Object, Key>> &arr,
+    const SemisortConfig &config = SemisortConfig())
+{
+    semi_sort(arr, config);
+
+    size_t n = arr.size();
+    auto group_starts = parlay::pack_index(parlay::delayed_seq<bool>(n, [&](size_t i) {
+        return i == 0 || arr[i].hashed_key != arr[i - 1].hashed_key ||
+               (config.exact_keys && !(arr[i].key == arr[i - 1].key));
+    }));
+    size_t num_groups = group_starts.size();
+    return parlay::tabulate(num_groups, [&](size_t i) {
+        size_t group_end = (i + 1 < num_groups) ? group_starts[i + 1] : n;
+        return record_group<Object, Key>(arr[group_starts[i]].key, arr.cut(group_starts[i], group_end));
+    });
+}
+
+// Combine the objects of each group with monoid (monoid.f, monoid.identity) and
+// return one (key, total) per group. Records are reduced straight out of the
+// buckets built by build_buckets, so arr is left untouched and is never packed.
+// With config.exact_keys arr is semisorted and split first, then reduced group
+// by group, since a bucket may hold several keys with the same hash; inputs
+// semi_sort_without_alloc would sort directly go the same way. Either way a
+// group is what semisort_group_by returns: one hashed key, or one key with
+// config.exact_keys.
+template <class Object, class Key, class Index, class Monoid>
+auto semisort_reduce_by_key(
+    parlay::sequence<record<Object, Key>> &arr,
+    Monoid monoid,
+    SemisortWorkspace<Object, Key, Index> &ws,
+    const SemisortConfig &config = SemisortConfig())
+{
+    using Value = std::decay_t<decltype(monoid.identity)>;
+    if (config.exact_keys || (config.fast_paths && arr.size() < SMALL_SORT_MAX)) {
+        semi_sort_without_alloc(arr, ws, config);
+        size_t n = arr.size();
+        auto group_starts = parlay::pack_index(parlay::delayed_seq<bool>(n, [&](size_t i) {
+            return i == 0 || arr[i].hashed_key != arr[i - 1].hashed_key ||
+                   (config.exact_keys && !(arr[i].key == arr[i - 1].key));
+        }));
+        size_t num_groups = group_starts.size();
+        return parlay::tabulate(num_groups, [&](size_t g) {
+            size_t group_end = (g + 1 < num_groups) ? group_starts[g + 1] : n;
+            auto values = parlay::delayed_seq<Value>(group_end - group_starts[g], [&](size_t j) {
+                return (Value)arr[group_starts[g] + j].obj;
+            });
+            return std::pair<Key, Value>(arr[group_starts[g]].key, parlay::reduce(values, monoid));
+        });
+    }
+    build_buckets(arr, ws, config);
+
+    auto &buckets = ws.buckets;
+    size_t num_heavy_buckets = ws.num_heavy_buckets;
+    size_t num_all_buckets = num_heavy_buckets + ws.num_light_buckets;
+    auto bucket_at = [&](size_t b) {
+        return b < num_heavy_buckets ? ws.heavy_key_buckets[b] : ws.light_buckets[b - num_heavy_buckets];
+    };
+
+    // a heavy bucket holds one key spread between empty slots, a light bucket
+    // is sorted with its records packed at the front
+    auto is_group_end = [&](size_t j, size_t end_range) {
+        return j + 1 == end_range || buckets[j + 1].isEmpty() || buckets[j + 1].hashed_key != buckets[j].hashed_key;
+    };
+    parlay::sequence<size_t> group_offsets = parlay::tabulate(num_all_buckets, [&](size_t b) -> size_t {
+        auto bucket = bucket_at(b);
+        size_t start_range = bucket.offset;
+        size_t end_range = bucket.offset + bucket.size;
+        if (bucket.isHeavy) {
+            for (size_t j = start_range; j < end_range; j++)
+                if (!buckets[j].isEmpty())
+                    return 1;
+            return 0;
+        }
+        size_t num_groups = 0;
+        for (size_t j = start_range; j < end_range && !buckets[j].isEmpty(); j++)
+            num_groups += is_group_end(j, end_range);
+        return num_groups;
+    });
+    size_t num_groups = parlay::scan_inplace(group_offsets);
+
+    parlay::sequence<std::pair<Key, Value>> result(num_groups);
+    parallel_for(0, num_all_buckets, [&](size_t b) {
+        auto bucket = bucket_at(b);
+        size_t start_range = bucket.offset;
+        size_t end_range = bucket.offset + bucket.size;
+        size_t out = group_offsets[b];
+        if (bucket.isHeavy) {
+            if (out == (b + 1 < num_all_buckets ? group_offsets[b + 1] : num_groups))
+                return;
+            auto values = parlay::delayed_seq<Value>(bucket.size, [&](size_t j) {
+                return buckets[start_range + j].isEmpty() ? monoid.identity : (Value)buckets[start_range + j].obj;
+            });
+            size_t first = start_range;
+            while (buckets[first].isEmpty())
+                first++;
+            result[out] = {buckets[first].key, parlay::reduce(values, monoid)};
+            return;
+        }
+        Value total = monoid.identity;
+        for (size_t j = start_range; j < end_range && !buckets[j].isEmpty(); j++) {
+            total = monoid.f(total, (Value)buckets[j].obj);
+            if (is_group_end(j, end_range)) {
+                result[out++] = {buckets[j].key, total};
+                total = monoid.identity;
+            }
+        }
+    });
+    return result;
+}
+
+template <class Object, class Key, class Monoid>
+auto semisort_reduce_by_key(
+    parlay::sequence<record<Object, Key>> &arr, Monoid monoid, const SemisortConfig &config = SemisortConfig())
+{
+    if (!index_width_fits<uint32_t>(arr.size())) {
+        SemisortWorkspace<Object, Key, uint64_t> ws;
+        return semisort_reduce_by_key(arr, monoid, ws, config);
+    }
+    SemisortWorkspace<Object, Key> ws;
+    return semisort_reduce_by_key(arr, monoid, ws, config);
+}
@@ -0,0 +1,153 @@
+#pragma once
+#include "parlay/parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <random>
+#include <type_traits>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SEMISORT_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+// Multiply-shift hashing of integer keys into [1, 2^bits]: the top bits of
+// key * an odd multiplier. For a uniformly random odd multiplier two distinct
+// keys collide with probability at most 2 / 2^bits; MULTIPLY_SHIFT_SEED is the
+// fixed multiplier used when the caller does not draw one. The AVX2 and
+// AVX-512 kernels hash 4 and 8 keys per instruction and are picked at runtime;
+// every kernel returns the same hashes.
+const uint64_t MULTIPLY_SHIFT_SEED = 0xD6E8FEB86659FD93ull;
+
+inline uint64_t multiply_shift_hash(uint64_t key, uint32_t bits, uint64_t multiplier = MULTIPLY_SHIFT_SEED)
+{
+    return (key * multiplier >> (64 - bits)) + 1;
+}
+
+// a fresh random odd multiplier
+inline uint64_t draw_hash_multiplier()
+{
+    std::random_device rd;
+    return ((uint64_t)rd() << 32 | rd()) | 1;
+}
+
+enum class HashKernel
+{
+    Scalar,
+    Avx2,
+    Avx512
+};
+
+inline void hash_keys_scalar(
+    const uint64_t *keys, uint64_t *hashed_keys, size_t count, uint32_t bits, uint64_t multiplier)
+{
+    for (size_t i = 0; i < count; i++)
+        hashed_keys[i] = multiply_shift_hash(keys[i], bits, multiplier);
+}
+
+#ifdef SEMISORT_X86_DISPATCH
+__attribute__((target("avx2")))
+inline void hash_keys_avx2(
+    const uint64_t *keys, uint64_t *hashed_keys, size_t count, uint32_t bits, uint64_t multiplier)
+{
+    // no 64-bit multiply in AVX2, so build the low product from 32-bit halves:
+    // lo * lo + ((hi * lo + lo * hi) << 32)
+    const __m256i seed_lo = _mm256_set1_epi64x(multiplier & 0xFFFFFFFFull);
+    const __m256i seed_hi = _mm256_set1_epi64x(multiplier >> 32);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m128i shift = _mm_cvtsi32_si128(64 - bits);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i key = _mm256_loadu_si256((const __m256i *)(keys + i));
+        __m256i cross = _mm256_add_epi64(
+            _mm256_mul_epu32(_mm256_srli_epi64(key, 32), seed_lo), _mm256_mul_epu32(key, seed_hi));
+        __m256i product = _mm256_add_epi64(_mm256_mul_epu32(key, seed_lo), _mm256_slli_epi64(cross, 32));
+        _mm256_storeu_si256((__m256i *)(hashed_keys + i), _mm256_add_epi64(_mm256_srl_epi64(product, shift), one));
+    }
+    hash_keys_scalar(keys + i, hashed_keys + i, count - i, bits, multiplier);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+inline void hash_keys_avx512(
+    const uint64_t *keys, uint64_t *hashed_keys, size_t count, uint32_t bits, uint64_t multiplier)
+{
+    const __m512i seed = _mm512_set1_epi64(multiplier);
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m128i shift = _mm_cvtsi32_si128(64 - bits);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512i key = _mm512_loadu_si512((const void *)(keys + i));
+        __m512i product = _mm512_mullo_epi64(key, seed);
+        // full mask maskz form: GCC 12 warns on the undefined passthrough of _mm512_srl_epi64
+        __m512i top_bits = _mm512_maskz_srl_epi64((__mmask8)0xFF, product, shift);
+        _mm512_storeu_si512((void *)(hashed_keys + i), _mm512_add_epi64(top_bits, one));
+    }
+    hash_keys_scalar(keys + i, hashed_keys + i, count - i, bits, multiplier);
+}
+#endif
+
+inline bool hash_kernel_supported(HashKernel kernel)
+{
+#ifdef SEMISORT_X86_DISPATCH
+    if (kernel == HashKernel::Avx2)
+        return __builtin_cpu_supports("avx2");
+    if (kernel == HashKernel::Avx512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq");
+#endif
+    return kernel == HashKernel::Scalar;
+}
+
+// widest kernel this cpu runs, checked once
+inline HashKernel best_hash_kernel()
+{
+    static const HashKernel kernel = hash_kernel_supported(HashKernel::Avx512) ? HashKernel::Avx512
+                                     : hash_kernel_supported(HashKernel::Avx2) ? HashKernel::Avx2
+                                                                                : HashKernel::Scalar;
+    return kernel;
+}
+
+inline void hash_keys_multiply_shift(const uint64_t *keys, uint64_t *hashed_keys, size_t count, uint32_t bits,
+    uint64_t multiplier = MULTIPLY_SHIFT_SEED, HashKernel kernel = best_hash_kernel())
+{
+#ifdef SEMISORT_X86_DISPATCH
+    if (kernel == HashKernel::Avx512)
+        return hash_keys_avx512(keys, hashed_keys, count, bits, multiplier);
+    if (kernel == HashKernel::Avx2)
+        return hash_keys_avx2(keys, hashed_keys, count, bits, multiplier);
+#endif
+    hash_keys_scalar(keys, hashed_keys, count, bits, multiplier);
+}
+
+// integer keys are hashed as they are, anything else through hash_fn first
+template <class Key, class Hash>
+inline uint64_t hashable_key(const Key &key, const Hash &hash_fn)
+{
+    if constexpr (std::is_integral<Key>::value)
+        return (uint64_t)key;
+    else
+        return (uint64_t)hash_fn(key);
+}
+
+// Hash n keys in blocks: key_at(i) gives the i-th key as an integer and
+// store(i, hashed_key) receives its hash. Keys are staged through a small
+// buffer so the kernel sees contiguous input whatever the record layout, and
+// are hashed in place. The buffer is zeroed up front: the vector loops read it
+// through a pointer, so the compiler cannot see that only count keys are used.
+template <class KeyAt, class Store>
+inline void hash_keys(size_t n, uint32_t bits, KeyAt key_at, Store store, uint64_t multiplier = MULTIPLY_SHIFT_SEED,
+    HashKernel kernel = best_hash_kernel())
+{
+    const size_t block_size = 1024;
+    size_t num_blocks = (n + block_size - 1) / block_size;
+    parlay::parallel_for(0, num_blocks, [&](size_t b) {
+        uint64_t keys[block_size] = {};
+        size_t start = b * block_size;
+        size_t count = std::min(block_size, n - start);
+        for (size_t j = 0; j < count; j++)
+            keys[j] = (uint64_t)key_at(start + j);
+        hash_keys_multiply_shift(keys, keys, count, bits, multiplier, kernel);
+        for (size_t j = 0; j < count; j++)
+            store(start + j, keys[j]);
+    }, 1);
+}
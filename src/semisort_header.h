@@ -5,6 +5,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <random>
+#include <stdexcept>
 
 #include "semisort_helpers.h"
 
@@ -16,6 +17,46 @@ namespace constants
     const float DELTA_THRESHOLD = 1;
     const float F_C = 1.25;
     const float LIGHT_KEY_BUCKET_CONSTANT = 2;
+    // upper bound on the bucket array built by get_bucket_sizes, in records per
+    // input record (2.6-6.4 measured on uniform, exponential and zipfian inputs);
+    // SLACK covers the minimum bucket sizes for small n
+    const float BUCKET_SPACE_FACTOR = 8;
+    const size_t BUCKET_SPACE_SLACK = 1 << 16;
+    // light buckets with at least this many records use a comparison sort
+    // instead of the radix sort
+    const uint32_t LIGHT_COMPARISON_SORT_MIN = 1 << 16;
+    // smallest chunk of the heavy bucket region handled by one pack task
+    const size_t PACK_MIN_CHUNK_BYTES = 1 << 18;
+    // records the PrefetchCas scatter looks ahead, a power of two up to 64
+    const size_t SCATTER_PREFETCH_DISTANCE = 16;
+    // StagedCas: bytes of a staging block, sixteen cache lines, and bytes of
+    // the bucket array one block stages for: 256 pages of 4 KiB, well inside
+    // what the second level TLB maps, so the regions grow with the bucket array
+    const size_t SCATTER_STAGING_BLOCK_BYTES = 1024;
+    const size_t SCATTER_STAGING_REGION_BYTES = 1 << 20;
+    // semi_sort_rehashed comparison sorts inputs smaller than this
+    const size_t PARTITION_SORT_MIN = 1 << 10;
+    // light buckets semi_sort_sharded deals out to each worker
+    const size_t SHARD_BUCKETS_PER_WORKER = 64;
+    // how often semi_sort_sharded checks on its worker processes
+    const uint32_t SHARD_POLL_MICROSECONDS = 1000;
+    // classify_sample: share of the sample on heavy keys from which an input
+    // is Skewed or HeavyDominated, and the share of unique sampled keys from
+    // which an input without heavy keys is Distinct
+    const float SKEWED_HEAVY_MASS = 0.05;
+    const float HEAVY_DOMINATED_MASS = 0.5;
+    const float DISTINCT_UNIQUE_RATIO = 0.9;
+    // semi_sort_without_alloc sorts inputs smaller than SMALL_SORT_MAX by
+    // hashed key instead of sampling them, sequentially below
+    // SMALL_SEQUENTIAL_MAX; see the semisort_small_inputs benchmark
+    const size_t SMALL_SEQUENTIAL_MAX = 1 << 11;
+    const size_t SMALL_SORT_MAX = 1 << 15;
+    // samples with at most this many distinct keys take the per key counting
+    // scatter; see the semisort_few_keys benchmark
+    const size_t FEW_KEYS_MAX = 64;
+    // HeavyDetection::Sketch sizes buckets this much over the records they
+    // can receive, leaving the CAS scatter empty slots to probe for
+    const float SKETCH_BUCKET_SLACK = 1.25;
 }
 
 using namespace std;
@@ -26,113 +67,612 @@ const float SAMPLE_PROBABILITY_CONSTANT = constants::SAMPLE_PROBABILITY_CONSTANT
 const float DELTA_THRESHOLD = constants::DELTA_THRESHOLD;
 const float F_C = constants::F_C;
 const float LIGHT_KEY_BUCKET_CONSTANT = constants::LIGHT_KEY_BUCKET_CONSTANT;
+const float BUCKET_SPACE_FACTOR = constants::BUCKET_SPACE_FACTOR;
+const size_t BUCKET_SPACE_SLACK = constants::BUCKET_SPACE_SLACK;
+const uint32_t LIGHT_COMPARISON_SORT_MIN = constants::LIGHT_COMPARISON_SORT_MIN;
+const size_t PACK_MIN_CHUNK_BYTES = constants::PACK_MIN_CHUNK_BYTES;
+const size_t SCATTER_PREFETCH_DISTANCE = constants::SCATTER_PREFETCH_DISTANCE;
+const size_t SCATTER_STAGING_BLOCK_BYTES = constants::SCATTER_STAGING_BLOCK_BYTES;
+const size_t SCATTER_STAGING_REGION_BYTES = constants::SCATTER_STAGING_REGION_BYTES;
+const size_t PARTITION_SORT_MIN = constants::PARTITION_SORT_MIN;
+const size_t SHARD_BUCKETS_PER_WORKER = constants::SHARD_BUCKETS_PER_WORKER;
+const uint32_t SHARD_POLL_MICROSECONDS = constants::SHARD_POLL_MICROSECONDS;
+const float SKEWED_HEAVY_MASS = constants::SKEWED_HEAVY_MASS;
+const float HEAVY_DOMINATED_MASS = constants::HEAVY_DOMINATED_MASS;
+const float DISTINCT_UNIQUE_RATIO = constants::DISTINCT_UNIQUE_RATIO;
+const size_t SMALL_SEQUENTIAL_MAX = constants::SMALL_SEQUENTIAL_MAX;
+const size_t SMALL_SORT_MAX = constants::SMALL_SORT_MAX;
+const size_t FEW_KEYS_MAX = constants::FEW_KEYS_MAX;
+const float SKETCH_BUCKET_SLACK = constants::SKETCH_BUCKET_SLACK;
 
+// Hashed keys are drawn from [1, 2^bits] with 2^bits >= n^HASH_RANGE_K. Over
+// the per call draw of the multiplier (see SemisortConfig::hash_multiplier) two
+// distinct keys collide with probability at most 2 n^-HASH_RANGE_K; a fixed
+// multiplier gives no such bound for adversarial keys. Past n = 2^28 that bound
+// no longer fits in 64 bits and bits saturates at 63, where the expected number
+// of colliding pairs is still below n^2 / 2^63 (about 11 for n = 10^10). A power
+// of two range lets hashing and light bucket lookup shift instead of divide.
+inline uint32_t hash_range_bits(size_t n)
+{
+    double bits = ceil(HASH_RANGE_K * log2((double)max(n, (size_t)2)));
+    return (uint32_t)min(bits, 63.0);
+}
+
+inline uint64_t hash_range(size_t n)
+{
+    return 1ull << hash_range_bits(n);
+}
+
+// width of the hashed keys drawn and bucketed for n records under config
+inline uint32_t hashed_key_bits(size_t n, const SemisortConfig &config)
+{
+    return config.hash_bits ? min(config.hash_bits, hash_range_bits(n)) : hash_range_bits(n);
+}
+
+// multiplier keys are hashed with under config; entry points that hash call
+// with_hash_multiplier first so the sample and every later pass agree
+inline uint64_t hash_multiplier(const SemisortConfig &config)
+{
+    return config.hash_multiplier ? config.hash_multiplier | 1 : MULTIPLY_SHIFT_SEED;
+}
+
+inline SemisortConfig with_hash_multiplier(const SemisortConfig &config)
+{
+    SemisortConfig drawn = config;
+    if (!drawn.hash_multiplier)
+        drawn.hash_multiplier = draw_hash_multiplier();
+    return drawn;
+}
+
+// Constants for a call on this many workers whose sample has shape, from
+// config.profile if it has them. Tuned constants may not let the bucket array
+// outgrow BUCKET_SPACE_FACTOR * n: a heavy threshold below DELTA_THRESHOLD makes
+// more keys heavy, each with its own slack, and light buckets with fewer samples
+// each than the defaults give are sized further above their expected load, so
+// both are clamped to the defaults. sample_constant is what the call sampled with.
+inline SemisortTuning semisort_tuning(const SemisortConfig &config, SampleShape shape, float sample_constant = 0)
+{
+    SemisortTuning tuning = {SAMPLE_PROBABILITY_CONSTANT, DELTA_THRESHOLD, F_C, LIGHT_KEY_BUCKET_CONSTANT};
+    if (config.profile == nullptr || !config.profile->find(parlay::num_workers(), shape, tuning))
+        return tuning;
+    if (sample_constant > 0)
+        tuning.sample_probability_constant = sample_constant;
+    tuning.delta_threshold = max(tuning.delta_threshold, DELTA_THRESHOLD);
+    float default_slack = F_C * LIGHT_KEY_BUCKET_CONSTANT / SAMPLE_PROBABILITY_CONSTANT;
+    tuning.light_key_bucket_constant = min(tuning.light_key_bucket_constant,
+                                           default_slack * tuning.sample_probability_constant / tuning.f_c);
+    return tuning;
+}
+
+// Tell input shapes apart by their sorted sample: the share of unique keys and
+// the share of samples on keys seen more than gamma = DELTA_THRESHOLD * ln(n)
+// times, which get_bucket_sizes would make heavy. A run of L > gamma equal
+// keys has L - gamma positions i with key(i) == key(i + gamma), so the heavy
+// samples are those positions plus gamma per heavy run.
+template <class Object, class Key>
+SampleShape classify_sample(const parlay::sequence<record<Object, Key>> &samples, size_t num_samples, size_t n)
+{
+    size_t gamma = max((size_t)1, (size_t)(DELTA_THRESHOLD * log((double)n)));
+    auto key = [&](size_t i) { return samples[i].hashed_key; };
+    auto starts_run = [&](size_t i) { return i == 0 || key(i) != key(i - 1); };
+    auto in_heavy_run = [&](size_t i) { return i + gamma < num_samples && key(i) == key(i + gamma); };
+    auto positions = parlay::iota(num_samples);
+    size_t num_unique = parlay::count_if(positions, starts_run);
+    size_t heavy_windows = parlay::count_if(positions, in_heavy_run);
+    size_t heavy_runs = parlay::count_if(positions, [&](size_t i) { return starts_run(i) && in_heavy_run(i); });
+
+    double heavy_mass = (double)(heavy_windows + gamma * heavy_runs) / num_samples;
+    if (heavy_mass >= HEAVY_DOMINATED_MASS)
+        return SampleShape::HeavyDominated;
+    if (heavy_mass >= SKEWED_HEAVY_MASS)
+        return SampleShape::Skewed;
+    if ((double)num_unique / num_samples >= DISTINCT_UNIQUE_RATIO)
+        return SampleShape::Distinct;
+    return SampleShape::Duplicated;
+}
+
+// true if a bucket array for n records, bounded by BUCKET_SPACE_FACTOR * n
+// slots, has offsets and sizes that fit in Index (sizes lose their top bit)
+template <class Index>
+inline bool index_width_fits(size_t n)
+{
+    return BUCKET_SPACE_FACTOR * (double)n + BUCKET_SPACE_SLACK < (double)(std::numeric_limits<Index>::max() >> 1);
+}
+
+// Hash every record's key_of(record) into its hashed_key in parallel, integer
+// keys through the vectorized kernel; records already hashed are left alone
+template <class Object, class Key, class KeyOf>
+void hash_records(parlay::sequence<record<Object, Key>> &arr, const SemisortConfig &config, KeyOf key_of)
+{
+    if constexpr (!std::is_same<KeyOf, KeysHashed>::value) {
+        StatsClock clock;
+        hash_keys(
+            arr.size(), hashed_key_bits(arr.size(), config),
+            [&](size_t i) { return key_of(arr[i]); },
+            [&](size_t i, uint64_t hashed_key) { arr[i].hashed_key = hashed_key; }, hash_multiplier(config));
+        clock.lap(config.stats, &SemisortStats::hash_seconds);
+    }
+}
+
+// Semisort records whose hashed keys are not set yet. build_buckets hashes the
+// sample on its own and the rest of the keys once the buckets are laid out, so
+// the same pass finds every record's bucket for the scatter.
 template <class Object, class Key>
-void semi_sort_with_hash(parlay::sequence<record<Object, Key>> &arr)
+void semi_sort_with_hash(parlay::sequence<record<Object, Key>> &arr, const SemisortConfig &config = SemisortConfig())
 {
     hash<Key> hash_fn;
-    uint64_t k = pow(arr.size(), HASH_RANGE_K);
+    semi_sort(arr, with_hash_multiplier(config), nullptr,
+        [&](const record<Object, Key> &rec) { return hashable_key(rec.key, hash_fn); });
+}
 
-    // Hash every key in parallel
-    parallel_for(0, arr.size(), [&](size_t i)
-                 { arr[i].hashed_key = hash_fn(arr[i].key) % k + 1; });
+template <class Index, class Object, class Key, class KeyOf = KeysHashed>
+void semi_sort_with_index_width(
+    parlay::sequence<record<Object, Key>> &arr,
+    const SemisortConfig &config = SemisortConfig(),
+    SemisortFootprint *footprint = nullptr,
+    KeyOf key_of = KeyOf())
+{
+    if (config.sort_by_index) {
+        hash_records(arr, config, key_of);
+        SemisortIndexWorkspace<Object, Key, Index> ws;
+        semi_sort_by_index(arr, ws, config, footprint);
+        return;
+    }
 
-#ifdef DEBUG
-    cout << "Original Records w/ Hashed Keys: \n";
-    for (uint32_t i = 0; i < arr.size(); i++)
-    {
-        cout << arr[i].obj << " " << arr[i].key << " " << arr[i].hashed_key << endl;
+    // scratch space is sized by semi_sort_without_alloc once the sample size and
+    // bucket layout are known, so nothing is reserved up front
+    SemisortWorkspace<Object, Key, Index> ws;
+    semi_sort_without_alloc(arr, ws, config, footprint, key_of);
+}
+
+// key_of is KeysHashed for records that carry their hashed keys, see
+// semi_sort_with_hash for the others
+template <class Object, class Key, class KeyOf = KeysHashed>
+void semi_sort(
+    parlay::sequence<record<Object, Key>> &arr,
+    const SemisortConfig &config = SemisortConfig(),
+    SemisortFootprint *footprint = nullptr,
+    KeyOf key_of = KeyOf())
+{
+    // 32-bit offsets and counters unless the bucket array could pass 2^31 slots
+    if (!index_width_fits<uint32_t>(arr.size())) {
+        semi_sort_with_index_width<uint64_t>(arr, config, footprint, key_of);
+        return;
     }
-#endif
+    semi_sort_with_index_width<uint32_t>(arr, config, footprint, key_of);
+}
 
-    // Call the semisort function on the hashed keys
-    semi_sort(arr);
+// Semisort (index, hashed_key) records instead of arr itself and then gather the
+// payloads into their final positions in one pass. Every probe, sort and pack
+// moves 16 bytes instead of a whole record, which pays off once Object is large.
+// The gathered sequence is swapped into arr, so arr's old buffer becomes the
+// next call's gather target.
+template <class Object, class Key, class Index>
+void semi_sort_by_index(
+    parlay::sequence<record<Object, Key>> &arr,
+    SemisortIndexWorkspace<Object, Key, Index> &ws,
+    const SemisortConfig &config = SemisortConfig(),
+    SemisortFootprint *footprint = nullptr)
+{
+    size_t n = arr.size();
+    auto &index_records = ws.index_records;
+    ensure_size(index_records, n);
+    parallel_for(0, n, [&](size_t i) {
+        index_records[i] = {(Index)i, 0, arr[i].hashed_key};
+    });
+
+    // index records carry no keys, collisions are split once the records are back
+    SemisortConfig index_config = config;
+    index_config.exact_keys = false;
+    semi_sort_without_alloc(index_records, ws.index_ws, index_config, footprint);
+
+    // the gather is charged to packing
+    StatsClock clock;
+    ensure_size(ws.gathered, n);
+    parallel_for(0, n, [&](size_t i) {
+        ws.gathered[i] = arr[index_records[i].obj];
+    });
+    swap(arr, ws.gathered);
+    clock.lap(config.stats, &SemisortStats::pack_seconds);
+    if (config.exact_keys) {
+        split_collided_records(arr);
+        clock.lap(config.stats, &SemisortStats::split_seconds);
+    }
+
+    if (footprint != nullptr)
+        footprint->peak_bytes += index_records.size() * sizeof(index_record<Index>) +
+                                 ws.gathered.size() * sizeof(record<Object, Key>);
 }
 
-template <class Object, class Key>
-void semi_sort(parlay::sequence<record<Object, Key>> &arr)
+// Semisort records whose hashed keys all come from a narrow slice of the hash
+// range, such as one partition of semi_sort_external. Light buckets assume keys
+// spread over [1, 2^hashed_key_bits(n)], so (index, rehashed key) records are
+// semisorted instead and the records gathered in that order with their hashed
+// keys untouched. Distinct hashed keys whose rehashes collided share a group
+// afterwards and are split apart, by key with config.exact_keys.
+template <class Object, class Key, class Index>
+void semi_sort_rehashed(
+    parlay::sequence<record<Object, Key>> &arr,
+    SemisortIndexWorkspace<Object, Key, Index> &ws,
+    const SemisortConfig &config = SemisortConfig())
 {
     size_t n = arr.size();
-    auto int_scrap = parlay::sequence<uint64_t>::uninitialized(2 * n);
-    auto record_scrap = parlay::sequence<record<Object, Key>>::uninitialized(100 * n);
-    auto buckets = parlay::sequence<record<Object, Key>>::uninitialized(100 * n);
-    semi_sort_without_alloc(arr, int_scrap, record_scrap, buckets);
+    if (n < PARTITION_SORT_MIN) {
+        auto hashed_key_less = [](const record<Object, Key> &a, const record<Object, Key> &b) {
+            return a.hashed_key < b.hashed_key;
+        };
+        if (config.stable)
+            parlay::stable_sort_inplace(arr, hashed_key_less);
+        else
+            parlay::sort_inplace(arr, hashed_key_less);
+        if (config.exact_keys)
+            split_collided_records(arr);
+        return;
+    }
+
+    uint32_t bits = hashed_key_bits(n, config);
+    auto &index_records = ws.index_records;
+    ensure_size(index_records, n);
+    parallel_for(0, n, [&](size_t i) {
+        index_records[i] = {(Index)i, 0, (parlay::hash64(arr[i].hashed_key) >> (64 - bits)) + 1};
+    });
+    SemisortConfig index_config = config;
+    index_config.exact_keys = false;
+    semi_sort_without_alloc(index_records, ws.index_ws, index_config);
+
+    StatsClock clock;
+    ensure_size(ws.gathered, n);
+    parallel_for(0, n, [&](size_t i) {
+        ws.gathered[i] = arr[index_records[i].obj];
+    });
+    swap(arr, ws.gathered);
+    clock.lap(config.stats, &SemisortStats::pack_seconds);
+
+    auto group_starts = parlay::pack_index(parlay::delayed_seq<bool>(n, [&](size_t i) {
+        return i == 0 || index_records[i].hashed_key != index_records[i - 1].hashed_key;
+    }));
+    if (config.exact_keys)
+        split_collided_groups(arr, group_starts, [](const record<Object, Key> &r) { return r.key; });
+    else
+        split_collided_groups(arr, group_starts, [](const record<Object, Key> &r) { return r.hashed_key; });
+    clock.lap(config.stats, &SemisortStats::split_seconds);
+}
+
+// Semisort only the keys: permutation[i] is the input position of the i-th
+// element in semisorted order and group i is permutation[group_offsets[i],
+// group_offsets[i + 1]), the last group ending at keys.size(). keys may be any
+// random access range, e.g. a column or a parlay::delayed_seq over one, and is
+// never reordered or copied into records. hash_fn's output goes through the
+// multiply-shift kernel, since std::hash is the identity on integers and would
+// pile small keys into the first light bucket. With config.exact_keys groups
+// are split by comparing keys[i] == keys[j]. Index is the width of the
+// returned positions; inputs past index_width_fits<uint32_t> need uint64_t.
+// Only ws.index_ws and ws.index_records are used.
+template <class Index = uint32_t, class Seq, class Hash = hash<std::decay_t<decltype(std::declval<const Seq &>()[0])>>>
+SemisortIndices<Index> semisort_indices(
+    const Seq &keys,
+    SemisortIndexWorkspace<Index, Index, Index> &ws,
+    const SemisortConfig &config = SemisortConfig(),
+    Hash hash_fn = Hash())
+{
+    size_t n = keys.size();
+    StatsClock clock;
+    auto &index_records = ws.index_records;
+    ensure_size(index_records, n);
+    hash_keys(
+        n, hashed_key_bits(n, config),
+        [&](size_t i) { return hash_fn(keys[i]); },
+        [&](size_t i, uint64_t hashed_key) { index_records[i] = {(Index)i, 0, hashed_key}; },
+        hash_multiplier(with_hash_multiplier(config)));
+    clock.lap(config.stats, &SemisortStats::hash_seconds);
+
+    SemisortConfig index_config = config;
+    index_config.exact_keys = false;
+    semi_sort_without_alloc(index_records, ws.index_ws, index_config);
+
+    clock = StatsClock();
+    SemisortIndices<Index> result;
+    result.permutation = parlay::tabulate(n, [&](size_t i) {
+        return index_records[i].obj;
+    });
+    result.group_offsets = parlay::map(parlay::pack_index(parlay::delayed_seq<bool>(n, [&](size_t i) {
+        return i == 0 || index_records[i].hashed_key != index_records[i - 1].hashed_key;
+    })), [](size_t i) { return (Index)i; });
+    if (config.exact_keys)
+        result.group_offsets = split_collided_groups(result.permutation, result.group_offsets, [&](Index i) {
+            return keys[i];
+        });
+    clock.lap(config.stats, &SemisortStats::split_seconds);
+    return result;
 }
 
+template <class Index = uint32_t, class Seq>
+SemisortIndices<Index> semisort_indices(const Seq &keys, const SemisortConfig &config = SemisortConfig())
+{
+    SemisortIndexWorkspace<Index, Index, Index> ws;
+    return semisort_indices<Index>(keys, ws, config);
+}
+
+// Small inputs: group arr by sorting it on the hashed key, a comparison sort on
+// one worker for the smallest and an integer sort above that, which is stable
 template <class Object, class Key>
+void sort_small_input(parlay::sequence<record<Object, Key>> &arr, bool stable)
+{
+    auto hashed_key_less = [](const record<Object, Key> &a, const record<Object, Key> &b) {
+        return a.hashed_key < b.hashed_key;
+    };
+    if (arr.size() < SMALL_SEQUENTIAL_MAX && stable)
+        std::stable_sort(arr.begin(), arr.end(), hashed_key_less);
+    else if (arr.size() < SMALL_SEQUENTIAL_MAX)
+        std::sort(arr.begin(), arr.end(), hashed_key_less);
+    else
+        parlay::internal::integer_sort_inplace(make_slice(arr), [](const record<Object, Key> &r) { return r.hashed_key; }, 0);
+}
+
+// All scratch space lives in ws and is grown to what this call needs, never
+// shrunk, so callers that keep one workspace across batches stop allocating
+// once they have seen their largest input. Inputs under SMALL_SORT_MAX records
+// are sorted by sort_small_input without touching ws:
+//   int_scrap     n sample flags
+//   record_scrap  num_samples ~ SAMPLE_PROBABILITY_CONSTANT * n / log2(n) records
+//   sketches      HeavyDetection::Sketch instead of the two above: per block
+//                 about 4 * min(block size, 2 * n * p / (DELTA_THRESHOLD * ln(n)))
+//                 words, with p the sample rate the sample would be drawn at
+//   buckets       the bucket layout returned by get_bucket_sizes, at most
+//                 BUCKET_SPACE_FACTOR * n + BUCKET_SPACE_SLACK records: a larger
+//                 layout is dropped for the counting scatter's n (see build_buckets)
+//   bucket_ids    n bucket numbers, for the counting scatter or when key_of
+//                 leaves the hashing to build_buckets
+//   staging       StagedCas: SCATTER_STAGING_BLOCK_BYTES per worker for every
+//                 SCATTER_STAGING_REGION_BYTES of buckets
+template <class Object, class Key, class Index, class KeyOf = KeysHashed>
 void semi_sort_without_alloc(
     parlay::sequence<record<Object, Key>> &arr,
-    parlay::sequence<uint64_t> &int_scrap,
-    parlay::sequence<record<Object, Key>> &record_scrap,
-    parlay::sequence<record<Object, Key>> &buckets)
+    SemisortWorkspace<Object, Key, Index> &ws,
+    const SemisortConfig &config = SemisortConfig(),
+    SemisortFootprint *footprint = nullptr,
+    KeyOf key_of = KeyOf())
+{
+    size_t n = arr.size();
+    if (n == 0)
+        return;
+    // a workspace whose Index is too narrow for n (see index_width_fits) hands
+    // the call to a 64-bit workspace allocated for it
+    if constexpr (sizeof(Index) < sizeof(uint64_t)) {
+        if (!index_width_fits<Index>(n)) {
+            SemisortWorkspace<Object, Key, uint64_t> wide_ws;
+            semi_sort_without_alloc(arr, wide_ws, config, footprint, key_of);
+            return;
+        }
+    }
+    if (config.fast_paths && n < SMALL_SORT_MAX) {
+        // the whole input is sorted like one light bucket
+        hash_records(arr, config, key_of);
+        StatsClock clock;
+        sort_small_input(arr, config.stable);
+        count_layout(config.stats, n, 0, 0, 0);
+        clock.lap(config.stats, &SemisortStats::light_sort_seconds);
+        if (config.exact_keys) {
+            split_collided_records(arr);
+            clock.lap(config.stats, &SemisortStats::split_seconds);
+        }
+        if (footprint != nullptr)
+            *footprint = {n, 0, 0, 0, ws.bytes()};
+        return;
+    }
+    build_buckets(arr, ws, config, footprint, key_of);
+
+    // step 8, buckets from the counting scatter have no empty slots to pack
+    StatsClock clock;
+    if (ws.counted) {
+        parallel_for(0, arr.size(), [&](size_t i) {
+            arr[i] = ws.buckets[i];
+        });
+    } else {
+        pack_elements(arr, ws, PACK_MIN_CHUNK_BYTES);
+    }
+    clock.lap(config.stats, &SemisortStats::pack_seconds);
+
+    if (config.exact_keys) {
+        split_collided_records(arr);
+        clock.lap(config.stats, &SemisortStats::split_seconds);
+    }
+
+#ifdef DEBUG
+    cout << "final result" << endl;
+    for (size_t i = 0; i < arr.size(); i++)
+    {
+        cout << i << " " << arr[i].obj << " " << arr[i].key << " " << arr[i].hashed_key << endl;
+    }
+#endif
+}
+
+// config.exact_keys: arr is grouped by hashed key; move the records of every
+// key whose hash collided with another's into its own run
+template <class Object, class Key>
+void split_collided_records(parlay::sequence<record<Object, Key>> &arr)
+{
+    auto group_starts = parlay::pack_index(parlay::delayed_seq<bool>(arr.size(), [&](size_t i) {
+        return i == 0 || arr[i].hashed_key != arr[i - 1].hashed_key;
+    }));
+    split_collided_groups(arr, group_starts, [](const record<Object, Key> &r) { return r.key; });
+}
+
+// Steps 2-7: sample arr, lay out the heavy and light buckets and scatter every
+// record into ws.buckets. Afterwards each heavy bucket holds one hashed key with
+// empty slots in between and each light bucket is sorted with its records packed
+// at the front, so ws.buckets[0, ws.buckets_size) can be packed or reduced.
+// Records not hashed yet (key_of is not KeysHashed) are hashed after the layout
+// is known, in one pass that also writes every record's bucket to ws.bucket_ids;
+// the scatter then reads those instead of looking up each hashed key.
+template <class Object, class Key, class Index, class KeyOf = KeysHashed>
+void build_buckets(
+    parlay::sequence<record<Object, Key>> &arr,
+    SemisortWorkspace<Object, Key, Index> &ws,
+    const SemisortConfig &config = SemisortConfig(),
+    SemisortFootprint *footprint = nullptr,
+    KeyOf key_of = KeyOf())
 {
     // Create a frequency map for step 4
     size_t n = arr.size();
     parlay::random_generator gen;
     std::uniform_int_distribution<size_t> dis(0, n - 1);
+    if (n > std::numeric_limits<Index>::max())
+        throw std::runtime_error("build_buckets: Index cannot count the records");
+    SemisortStats *stats = config.stats;
+    StatsClock clock;
+    ws.reset();
+    clock.lap(stats, &SemisortStats::bucket_sizes_seconds);
 
     // Step 2
-    double logn = log2((double)n);
-    double p = min(SAMPLE_PROBABILITY_CONSTANT / logn, 0.25); // this is theta(1 / log n) so we can autotune later
-    uint32_t num_samples = floor(n * p) - 1;
-    assert(num_samples != 0);
-
-    get_sampled_elements(arr, int_scrap, record_scrap, num_samples, n, gen, dis);
-
-    // hash table T
-    parlay::hashtable<hash_buckets> hash_table(2 * n, hash_buckets());
-    parlay::sequence<Bucket> heavy_key_buckets;
-    uint32_t num_buckets = LIGHT_KEY_BUCKET_CONSTANT * ((double)n / logn / logn + 1);
-    parlay::sequence<Bucket> light_buckets(num_buckets);
-    size_t nk = pow(arr.size(), HASH_RANGE_K);
-    uint64_t bucket_range = (double)nk / (double)num_buckets;
-    uint32_t current_bucket_offset = get_bucket_sizes(
-        arr, int_scrap, record_scrap, hash_table,
-        heavy_key_buckets, light_buckets,
-        num_samples, num_buckets, bucket_range, n, DELTA_THRESHOLD, p, F_C
-    );
-    uint32_t buckets_size = current_bucket_offset + n;
-
-    // insert buckets into table in parallel
-    parallel_for(0, heavy_key_buckets.size(), [&](size_t i) { 
-        hash_table.insert(heavy_key_buckets[i]); 
-    });
-    parallel_for(0, num_buckets, [&](size_t i) { 
-        hash_table.insert(light_buckets[i]); 
-    });
+    SemisortTuning tuning = semisort_tuning(config, SampleShape::Any);
+    double logn = log2((double)max(n, (size_t)2));
+    double p = min(tuning.sample_probability_constant / logn, 0.25); // this is theta(1 / log n)
+    bool sketched = config.heavy_detection == HeavyDetection::Sketch;
+    size_t num_samples = sketched ? 0 : max(floor(n * p) - 1, 1.0);
+    uint32_t bits = hashed_key_bits(n, config);
+    uint64_t multiplier = hash_multiplier(config);
+
+    // the sketch reads every hashed key, so records are hashed up front for it
+    bool hash_with_buckets = !std::is_same<KeyOf, KeysHashed>::value && !sketched;
+    if (sketched) {
+        hash_records(arr, config, key_of);
+        clock = StatsClock();
+    }
+    auto hashed_key_of = [&](const record<Object, Key> &rec) {
+        if constexpr (std::is_same<KeyOf, KeysHashed>::value)
+            return rec.hashed_key;
+        else
+            return multiply_shift_hash(key_of(rec), bits, multiplier);
+    };
+
+    // few distinct keys: every sampled key is made heavy (threshold 0), the
+    // keys the sample missed share a single light bucket, and the counting
+    // scatter places each record in its key's exactly sized bucket
+    bool few_keys = false;
+    if (!sketched) {
+        ensure_capacity(ws.int_scrap, n);
+        ensure_capacity(ws.record_scrap, num_samples);
+        if (hash_with_buckets)
+            get_sampled_elements(arr, ws.int_scrap, ws.record_scrap, num_samples, n, gen, dis, stats, hashed_key_of);
+        else
+            get_sampled_elements(arr, ws.int_scrap, ws.record_scrap, num_samples, n, gen, dis, stats);
+        clock = StatsClock();
+        if (config.profile != nullptr)
+            tuning = semisort_tuning(config, classify_sample(ws.record_scrap, num_samples, n), tuning.sample_probability_constant);
+        few_keys = config.fast_paths &&
+                   parlay::count_if(parlay::iota(num_samples), [&](size_t i) {
+                       return i == 0 || ws.record_scrap[i].hashed_key != ws.record_scrap[i - 1].hashed_key;
+                   }) <= FEW_KEYS_MAX;
+    }
+
+    // light buckets cover power of two ranges of hashed keys, so their count is
+    // rounded down to a power of two and a record's bucket is found by a shift
+    size_t target_num_buckets = tuning.light_key_bucket_constant * ((double)n / logn / logn + 1);
+    uint32_t log_num_buckets = few_keys ? 0 : min(bits, (uint32_t)(63 - __builtin_clzll(target_num_buckets)));
+    uint32_t bucket_shift = bits - log_num_buckets;
+    size_t num_buckets = 1ull << (bits - bucket_shift);
+    size_t current_bucket_offset = sketched
+        ? get_bucket_sizes_sketched(arr, ws, num_buckets, bucket_shift, n, tuning.delta_threshold, p, SKETCH_BUCKET_SLACK)
+        : get_bucket_sizes(ws, num_samples, num_buckets, bucket_shift, n, few_keys ? 0 : tuning.delta_threshold, p, tuning.f_c);
+    // the counting scatter packs the buckets back to back in exactly n slots;
+    // it also takes over if the layout is past BUCKET_SPACE_FACTOR * n (which
+    // the sample only rules out with high probability) or past what Index
+    // can address
+    bool oversized = current_bucket_offset > BUCKET_SPACE_FACTOR * n + BUCKET_SPACE_SLACK ||
+                     current_bucket_offset > std::numeric_limits<Index>::max();
+    ws.counted = few_keys || oversized || config.stable || config.scatter_engine == ScatterEngine::CountingPlace;
+    size_t buckets_size = ws.counted ? n : current_bucket_offset;
+
+    // empty slots are marked by hashed_key == 0; reset() cleared the slots the
+    // previous call used and grown space starts out empty
+    ensure_bucket_capacity(ws, buckets_size, config.numa_placement);
+    ws.buckets_size = buckets_size;
+    auto &buckets = ws.buckets;
+    auto &heavy_key_buckets = ws.heavy_key_buckets;
+    auto &light_buckets = ws.light_buckets;
+
+    // heavy keys go in a small table, light buckets are indexed directly
+    ws.heavy_table.build(heavy_key_buckets, ws.num_heavy_buckets);
+    count_layout(stats, n, ws.num_heavy_buckets, num_buckets, buckets_size);
+    clock.lap(stats, &SemisortStats::bucket_sizes_seconds);
 
 #ifdef DEBUG
     cout << "buckets" << endl;
-    parlay::sequence<Bucket> entries = hash_table.entries();
-    for (uint32_t i = 0; i < entries.size(); i++)
+    for (size_t i = 0; i < ws.num_heavy_buckets + num_buckets; i++)
     {
-        cout << entries[i].bucket_id << " " << entries[i].offset << " " << entries[i].size << " " << entries[i].isHeavy << " " << endl;
+        BasicBucket<Index> entry = (i < ws.num_heavy_buckets) ? heavy_key_buckets[i] : light_buckets[i - ws.num_heavy_buckets];
+        cout << entry.bucket_id << " " << entry.offset << " " << entry.size << " " << entry.isHeavy << " " << endl;
     }
 #endif
 
-    uint32_t num_partitions = (int)((double)n / logn);
+    // hash the records and find their buckets in one pass
+    if constexpr (!std::is_same<KeyOf, KeysHashed>::value) {
+        if (hash_with_buckets) {
+            ensure_capacity(ws.bucket_ids, n);
+            hash_keys(
+                n, bits, [&](size_t i) { return key_of(arr[i]); },
+                [&](size_t i, uint64_t hashed_key) {
+                    arr[i].hashed_key = hashed_key;
+                    ws.bucket_ids[i] = bucket_number(ws, hashed_key, bucket_shift, num_buckets);
+                },
+                multiplier);
+            clock.lap(stats, &SemisortStats::hash_seconds);
+        }
+    }
+
+    size_t num_partitions = (size_t)((double)n / logn);
     // scatter keys
-    scatter_keys(arr, buckets, hash_table, n, logn, num_partitions, bucket_range, gen, dis, true);
-    scatter_keys(arr, buckets, hash_table, n, logn, num_partitions, bucket_range, gen, dis, false);
+    auto scatter = [&](auto bucket_of) {
+        if (ws.counted) {
+            scatter_keys_counting(arr, ws, num_buckets, bucket_shift, n, hash_with_buckets);
+        } else if (ws.bucket_placement == NumaPlacement::Local) {
+            scatter_keys_numa(arr, ws, bucket_of, n, gen, dis, stats);
+        } else if (config.scatter_engine == ScatterEngine::PrefetchCas) {
+            scatter_keys_prefetch(arr, buckets, bucket_of, n, gen, dis, SCATTER_PREFETCH_DISTANCE, stats);
+        } else if (config.scatter_engine == ScatterEngine::StagedCas) {
+            scatter_keys_staged(arr, ws, bucket_of, n, gen, dis, SCATTER_STAGING_BLOCK_BYTES, SCATTER_STAGING_REGION_BYTES, stats);
+        } else if (config.fused_scatter) {
+            scatter_keys(arr, buckets, bucket_of, n, logn, num_partitions, gen, dis, ScatterKeys::All, stats);
+        } else {
+            StatsClock pass_clock;
+            scatter_keys(arr, buckets, bucket_of, n, logn, num_partitions, gen, dis, ScatterKeys::Heavy, stats);
+            pass_clock.lap(stats, &SemisortStats::heavy_scatter_seconds);
+            scatter_keys(arr, buckets, bucket_of, n, logn, num_partitions, gen, dis, ScatterKeys::Light, stats);
+            pass_clock.lap(stats, &SemisortStats::light_scatter_seconds);
+        }
+    };
+    if (hash_with_buckets) {
+        scatter([&](size_t i) { return bucket_at(ws, ws.bucket_ids[i]); });
+    } else {
+        // light buckets are contiguous ranges of hashed keys, so only the
+        // heavy check needs a lookup
+        scatter([&](size_t i) {
+            BasicBucket<Index> entry;
+            if (!ws.heavy_table.find(arr[i].hashed_key, entry))
+                entry = light_buckets[light_bucket_index(arr[i].hashed_key, bucket_shift, num_buckets)];
+            return entry;
+        });
+    }
+    clock.lap(stats, &SemisortStats::scatter_seconds);
 
     // Step 7b, 7c
-    sort_light_buckets(buckets, light_buckets, n, num_buckets);
+    ensure_capacity(ws.light_counts, num_buckets);
+    sort_light_buckets(buckets, light_buckets, ws.light_counts, num_buckets, LIGHT_COMPARISON_SORT_MIN, config.stable);
+    clock.lap(stats, &SemisortStats::light_sort_seconds);
 #ifdef DEBUG
     cout << "bucket" << endl;
-    for (uint32_t i = 0; i < buckets_size; i++)
+    for (size_t i = 0; i < buckets_size; i++)
     {
         cout << i << " " << buckets[i].obj << " " << buckets[i].key << " " << buckets[i].hashed_key << endl;
     }
 #endif
 
-    // step 8
-    pack_elements(arr, buckets, buckets_size);
-
-#ifdef DEBUG
-    cout << "final result" << endl;
-    for (uint32_t i = 0; i < arr.size(); i++)
-    {
-        cout << i << " " << arr[i].obj << " " << arr[i].key << " " << arr[i].hashed_key << endl;
+    if (footprint != nullptr) {
+        footprint->n = n;
+        footprint->num_samples = num_samples;
+        footprint->bucket_slots = buckets_size;
+        footprint->heavy_table_slots = ws.heavy_table.table_size;
+        footprint->peak_bytes = ws.bytes();
     }
-#endif
 }
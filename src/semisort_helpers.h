@@ -1,11 +1,13 @@
+#pragma once
 #include "semisort_types.h"
-#define DEBUG 1
+#include "semisort_hash.h"
+#include "semisort_numa.h"
 
 using namespace std;
 using parlay::parallel_for;
 using parlay::make_slice;
 
-inline unsigned int size_func(unsigned int num_records, double p, unsigned int n, double c)
+inline size_t size_func(size_t num_records, double p, size_t n, double c)
 {
     double lnn = (double)log((double)n);
     double clnn = c * lnn;
@@ -13,97 +15,180 @@ inline unsigned int size_func(unsigned int num_records, double p, unsigned int n
     double fs = (num_records + clnn + sqrt(clnn * clnn + 2 * num_records * c * clnn)) / p;
     double array_size = 1.1 * fs;
 
-    return (unsigned int)pow(2, ceil(log(array_size) / log(2)));
+    return (size_t)pow(2, ceil(log(array_size) / log(2)));
 }
 
-template <class eType>
-inline bool bucket_cas(eType *p, eType o, eType n)
+// light buckets split [1, 2^bits] into num_buckets ranges of 2^bucket_shift
+// hashed keys; the last bucket also takes anything above the range
+inline uint64_t light_bucket_index(uint64_t hashed_key, uint32_t bucket_shift, uint64_t num_buckets)
 {
-    return std::atomic_compare_exchange_strong_explicit(
-        reinterpret_cast<std::atomic<eType> *>(p), &o, n, std::memory_order_relaxed, std::memory_order_relaxed);
+    uint64_t bucket_num = (hashed_key - 1) >> bucket_shift;
+    return bucket_num < num_buckets ? bucket_num : num_buckets - 1;
 }
 
-// round n down to nearest multiple of m
-uint64_t round_down(uint64_t n, uint64_t m)
+// number of the bucket of hashed_key once the heavy table is built: the heavy
+// buckets come first, then the light buckets
+template <class Object, class Key, class Index>
+inline size_t bucket_number(
+    const SemisortWorkspace<Object, Key, Index> &ws,
+    uint64_t hashed_key,
+    uint32_t bucket_shift,
+    size_t num_buckets)
 {
-    return n >= 0 ? (n / m) * m : ((n - m + 1) / m) * m;
+    uint32_t heavy_index;
+    return ws.heavy_table.find_index(hashed_key, heavy_index)
+        ? heavy_index
+        : ws.num_heavy_buckets + light_bucket_index(hashed_key, bucket_shift, num_buckets);
 }
 
-template <class Object, class Key>
+template <class Object, class Key, class Index>
+inline BasicBucket<Index> bucket_at(const SemisortWorkspace<Object, Key, Index> &ws, size_t bucket_num)
+{
+    return bucket_num < ws.num_heavy_buckets ? ws.heavy_key_buckets[bucket_num]
+                                             : ws.light_buckets[bucket_num - ws.num_heavy_buckets];
+}
+
+// Sample num_samples records of arr into record_scrap, sorted by hashed key.
+// Records not hashed yet get their hashed keys from hashed_key_of(record).
+template <class Object, class Key, class HashedKeyOf = KeysHashed>
 inline void get_sampled_elements(
     parlay::sequence<record<Object, Key>> &arr,
     parlay::sequence<uint64_t> &int_scrap,
     parlay::sequence<record<Object, Key>> &record_scrap,
-    int num_samples,
-    int n,
+    size_t num_samples,
+    size_t n,
     parlay::random_generator gen,
-    std::uniform_int_distribution<size_t> dis)
+    std::uniform_int_distribution<size_t> dis,
+    SemisortStats *stats = nullptr,
+    HashedKeyOf hashed_key_of = HashedKeyOf())
 {
-    // Choose which items to sample
+    StatsClock clock;
+    // Choose which items to sample, one per stratum of n / num_samples records
+    size_t stratum = n / num_samples;
+    parallel_for(0, n, [&](size_t i) {
+        int_scrap[i] = false;
+    });
     parallel_for(0, num_samples, [&](size_t i) {
 	    auto r = gen[i];
-	    int_scrap[(uint64_t)(dis(r) % (n / num_samples) + i * n / num_samples)] = true; 
+	    int_scrap[dis(r) % stratum + i * stratum] = true; 
     });
 
-    // // Pack sampled elements into smaller vector
-    parlay::pack_into_uninitialized(
+    // Pack sampled elements into smaller vector
+    size_t num_packed = parlay::pack_into_uninitialized(
         arr, 
-        make_slice(int_scrap.begin(), int_scrap.begin()), 
+        int_scrap.cut(0, n), 
         record_scrap
     );
+    assert(num_packed == num_samples);
+    (void)num_packed;
+    if constexpr (!std::is_same<HashedKeyOf, KeysHashed>::value) {
+        parallel_for(0, num_samples, [&](size_t i) {
+            record_scrap[i].hashed_key = hashed_key_of(record_scrap[i]);
+        });
+    }
+    clock.lap(stats, &SemisortStats::sample_seconds);
 
     // Step 3 sort samples so we can more easily determine offsets
     auto comp = [&](record<Object, Key> x)
     { return x.hashed_key; };
+    // key_bits 0: sort on every bit of the hashed key, get_bucket_sizes needs
+    // equal keys adjacent and the unique keys in order
     parlay::internal::integer_sort_inplace(
         parlay::make_slice(record_scrap.begin(), record_scrap.begin() + num_samples),
         comp,
-        sizeof(uint64_t));
+        0);
+    clock.lap(stats, &SemisortStats::sort_samples_seconds);
 
 #ifdef DEBUG
     cout << "Sample Objects:" << endl;
-    for (uint32_t i = 0; i < num_samples; i++)
+    for (size_t i = 0; i < num_samples; i++)
     {
         cout << record_scrap[i].obj << " " << record_scrap[i].key << " " << record_scrap[i].hashed_key << endl;
     }
 #endif
 }
 
-template <class Object, class Key>
-inline uint32_t get_bucket_sizes(
-    parlay::sequence<record<Object, Key>> &arr,
-    parlay::sequence<uint64_t> &int_scrap,
-    parlay::sequence<record<Object, Key>> &record_scrap,
-    parlay::hashtable<hash_buckets> &hash_table,
-    parlay::sequence<Bucket> &heavy_key_buckets,
-    parlay::sequence<Bucket> &light_buckets,
-    uint32_t num_samples,
-    uint32_t num_buckets,
-    uint64_t bucket_range,
+// Size the light buckets with light_size(i) and lay out every bucket, the
+// num_heavy_buckets heavy ones (whose sizes are set) first, with a scan over
+// their sizes. Returns the slots the layout takes; if Index cannot address
+// them the offsets are left unset.
+template <class Object, class Key, class Index, class LightSize>
+inline size_t lay_out_buckets(
+    SemisortWorkspace<Object, Key, Index> &ws,
+    size_t num_heavy_buckets,
+    size_t num_buckets,
+    uint32_t bucket_shift,
+    LightSize light_size)
+{
+    auto &heavy_key_buckets = ws.heavy_key_buckets;
+    auto &light_buckets = ws.light_buckets;
+    uint64_t bucket_range = 1ull << bucket_shift;
+    size_t num_all_buckets = num_heavy_buckets + num_buckets;
+    ensure_capacity(light_buckets, num_buckets);
+    ensure_capacity(ws.layout_offsets, num_all_buckets);
+    auto &layout_offsets = ws.layout_offsets;
+    parallel_for(0, num_buckets, [&](size_t i) {
+        light_buckets[i] = {i * bucket_range + 1, 0, (Index)light_size(i), false};
+    });
+    auto bucket_size = [&](size_t i) -> size_t {
+        return (i < num_heavy_buckets) ? heavy_key_buckets[i].size : light_buckets[i - num_heavy_buckets].size;
+    };
+    ws.num_heavy_buckets = num_heavy_buckets;
+    ws.num_light_buckets = num_buckets;
+    size_t total_size = parlay::reduce(parlay::delayed_seq<size_t>(num_all_buckets, bucket_size));
+    if (total_size > std::numeric_limits<Index>::max())
+        return total_size;
+    parallel_for(0, num_all_buckets, [&](size_t i) {
+        layout_offsets[i] = bucket_size(i);
+    });
+    size_t current_bucket_offset = parlay::scan_inplace(layout_offsets.cut(0, num_all_buckets));
+    parallel_for(0, num_all_buckets, [&](size_t i) {
+        if (i < num_heavy_buckets)
+            heavy_key_buckets[i].offset = layout_offsets[i];
+        else
+            light_buckets[i - num_heavy_buckets].offset = layout_offsets[i];
+    });
+    return current_bucket_offset;
+}
+
+template <class Object, class Key, class Index>
+inline size_t get_bucket_sizes(
+    SemisortWorkspace<Object, Key, Index> &ws,
+    size_t num_samples,
+    size_t num_buckets,
+    uint32_t bucket_shift,
     size_t n,
     float DELTA_THRESHOLD,
     float p,
     float F_C)
 {
+    auto &record_scrap = ws.record_scrap;
+    auto &heavy_key_buckets = ws.heavy_key_buckets;
+    auto &light_buckets = ws.light_buckets;
+    using Bucket = BasicBucket<Index>;
+
     // Step 4
     uint32_t gamma = DELTA_THRESHOLD * log(n);
-    parlay::sequence<uint64_t> differences = int_scrap;
+    ensure_capacity(ws.differences, num_samples);
+    auto &differences = ws.differences;
     // get array differences
-    parallel_for(0, num_samples, [&](size_t i) {
-        if (record_scrap[i].hashed_key != record_scrap[i+1].hashed_key){
-            differences[i] = i+1;
-        } 
+    parallel_for(0, num_samples - 1, [&](size_t i) {
+        differences[i] = (record_scrap[i].hashed_key != record_scrap[i+1].hashed_key) ? i + 1 : 0;
     });
     differences[num_samples - 1] = num_samples;
 
     // get offsets of differences in sorted array
-    auto offset_filter = [&](uint32_t x)
+    auto offset_filter = [&](uint64_t x)
     { return x != 0; };
-    parlay::sequence<uint64_t> offsets = parlay::filter(differences, offset_filter);
+    ensure_capacity(ws.offsets, num_samples);
+    auto &offsets = ws.offsets;
+    size_t num_unique_in_sample = parlay::filter_into_uninitialized(
+        differences.cut(0, num_samples), offsets, offset_filter);
 
-    size_t num_unique_in_sample = offsets.size();
-    parlay::sequence<uint64_t> counts(num_unique_in_sample);
-    parlay::sequence<uint64_t> unique_hashed_keys(num_unique_in_sample);
+    ensure_capacity(ws.counts, num_unique_in_sample);
+    ensure_capacity(ws.unique_hashed_keys, num_unique_in_sample);
+    auto &counts = ws.counts;
+    auto &unique_hashed_keys = ws.unique_hashed_keys;
 
     // save the unique hashed keys into an array for future use
     parallel_for(0, num_unique_in_sample, [&](size_t i){
@@ -116,55 +201,65 @@ inline uint32_t get_bucket_sizes(
         counts[i] = offsets[i] - offsets[i - 1]; 
     });
 
-    // calculate the number of light buckets we want
-    parlay::sequence<uint32_t> light_key_bucket_sample_counts(num_buckets);
+    ensure_capacity(heavy_key_buckets, num_unique_in_sample);
+    ensure_capacity(light_buckets, num_buckets);
+    ensure_capacity(ws.light_key_bucket_sample_counts, num_buckets);
+    ensure_capacity(ws.light_sample_prefix, num_unique_in_sample + 1);
+    auto &light_key_bucket_sample_counts = ws.light_key_bucket_sample_counts;
+    auto &light_sample_prefix = ws.light_sample_prefix;
 
-    // add heavy buckets and count number of light items in light buckets
-    uint32_t current_bucket_offset = 0;
-    for (uint32_t i = 0; i < num_unique_in_sample; i++)
-    {
-        if (counts[i] > gamma)
-        {
-            uint32_t bucket_size = (uint32_t)size_func(counts[i], p, n, F_C);
-            Bucket new_heavy_bucket = {unique_hashed_keys[i], current_bucket_offset, bucket_size, true};
-            heavy_key_buckets.push_back(new_heavy_bucket);
-            current_bucket_offset += bucket_size;
-        }
-        else
-        {
-            // determine how big we should make the buckets
-            uint64_t bucket_num = unique_hashed_keys[i] / bucket_range;
-            light_key_bucket_sample_counts[bucket_num] += counts[i];
-        }
-    }
+    // add heavy buckets, keys seen more than gamma times in the sample
+    auto is_heavy = [&](size_t i) { return counts[i] > gamma; };
+    size_t num_heavy_buckets = parlay::filter_into_uninitialized(
+        parlay::delayed_seq<Bucket>(num_unique_in_sample, [&](size_t i) {
+            Index bucket_size = is_heavy(i) ? size_func(counts[i], p, n, F_C) : 0;
+            return Bucket{unique_hashed_keys[i], 0, bucket_size, is_heavy(i)};
+        }),
+        heavy_key_buckets,
+        [&](Bucket bucket) { return bucket.isHeavy; });
 
-    for (uint32_t i = 0; i < num_buckets; i++)
-    {
-        uint32_t bucket_size = size_func(light_key_bucket_sample_counts[i], p, n, F_C);
-        Bucket new_light_bucket = {i * bucket_range, current_bucket_offset, bucket_size, false};
-        light_buckets[i] = new_light_bucket;
-        current_bucket_offset += bucket_size;
-    }
+    // count number of light items in light buckets: the samples are sorted, so
+    // the keys of a light bucket are a run of unique_hashed_keys found by binary
+    // search and summed with a prefix sum over the light counts
+    parallel_for(0, num_unique_in_sample, [&](size_t i) {
+        light_sample_prefix[i] = is_heavy(i) ? 0 : counts[i];
+    });
+    light_sample_prefix[num_unique_in_sample] = 0;
+    parlay::scan_inplace(light_sample_prefix.cut(0, num_unique_in_sample + 1));
+    auto first_unique_at = [&](uint64_t hashed_key) -> size_t {
+        return std::lower_bound(unique_hashed_keys.begin(), unique_hashed_keys.begin() + num_unique_in_sample, hashed_key) - unique_hashed_keys.begin();
+    };
+    uint64_t bucket_range = 1ull << bucket_shift;
+    parallel_for(0, num_buckets, [&](size_t i) {
+        size_t start_range = (i == 0) ? 0 : first_unique_at(i * bucket_range + 1);
+        size_t end_range = (i + 1 == num_buckets) ? num_unique_in_sample : first_unique_at((i + 1) * bucket_range + 1);
+        light_key_bucket_sample_counts[i] = light_sample_prefix[end_range] - light_sample_prefix[start_range];
+    });
+
+    // determine how big we should make the buckets and lay them out
+    size_t current_bucket_offset = lay_out_buckets(ws, num_heavy_buckets, num_buckets, bucket_shift, [&](size_t i) {
+        return size_func(light_key_bucket_sample_counts[i], p, n, F_C);
+    });
 
 #ifdef DEBUG
     cout << "differences, offsets, uniques" << endl;
-    for (uint32_t i = 0; i < num_samples; i++)
+    for (size_t i = 0; i < num_samples; i++)
     {
         cout << differences[i] << ", ";
     }
     cout << endl;
-    for (uint32_t i = 0; i < num_unique_in_sample; i++)
+    for (size_t i = 0; i < num_unique_in_sample; i++)
     {
         cout << offsets[i] << ", ";
     }
     cout << endl;
-    for (uint32_t i = 0; i < num_unique_in_sample; i++)
+    for (size_t i = 0; i < num_unique_in_sample; i++)
     {
         cout << unique_hashed_keys[i] << ", ";
     }
     cout << endl;
     cout << "counts to bucket sizes" << endl;
-    for (uint32_t i = 0; i < num_unique_in_sample; i++)
+    for (size_t i = 0; i < num_unique_in_sample; i++)
     {
         cout << counts[i] << endl;
     }
@@ -173,144 +268,676 @@ inline uint32_t get_bucket_sizes(
     return current_bucket_offset;
 }
 
-template <class Object, class Key>
+// HeavyDetection::Sketch version of get_bucket_sizes. Each block of arr runs a
+// Misra-Gries sketch over its hashed keys and a histogram over light buckets;
+// the merged sketch counts undercount a key by at most the summed decrements,
+// error, which is kept under half of the heavy threshold: the records a key
+// needs to be seen more than DELTA_THRESHOLD * log n times in a sample at rate
+// p. Keys counted above the threshold less the error are heavy, so every key
+// past the threshold is, and a heavy bucket holds its merged count plus the
+// error. A light bucket holds the records of its range less the merged counts
+// of its heavy keys. Both are bounds rather than estimates and only grow by
+// slack, so no bucket can overflow. Returns the slots the layout takes.
+template <class Object, class Key, class Index>
+inline size_t get_bucket_sizes_sketched(
+    parlay::sequence<record<Object, Key>> &arr,
+    SemisortWorkspace<Object, Key, Index> &ws,
+    size_t num_buckets,
+    uint32_t bucket_shift,
+    size_t n,
+    float DELTA_THRESHOLD,
+    float p,
+    float slack)
+{
+    using Bucket = BasicBucket<Index>;
+    double threshold = max(floor(DELTA_THRESHOLD * log(n)) / p, 1.0);
+    size_t counters = (size_t)ceil(2 * n / threshold);
+
+    // a block per worker, but no more than about n histogram counts in total
+    size_t num_blocks = max((size_t)1, min(parlay::num_workers(), n / num_buckets));
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+    ensure_capacity(ws.sketches, num_blocks);
+    ensure_capacity(ws.block_counts, num_buckets * num_blocks);
+    auto &sketches = ws.sketches;
+    auto &block_counts = ws.block_counts;
+    parallel_for(0, num_blocks, [&](size_t block) {
+        size_t start_range = min(n, block * block_size);
+        size_t end_range = min(n, start_range + block_size);
+        HeavyHitterSketch &sketch = sketches[block];
+        sketch.reset(max((size_t)1, min(counters, end_range - start_range)));
+        Index *counts = block_counts.data() + block * num_buckets;
+        std::fill(counts, counts + num_buckets, 0);
+        for (size_t i = start_range; i < end_range; i++) {
+            sketch.add(arr[i].hashed_key);
+            counts[light_bucket_index(arr[i].hashed_key, bucket_shift, num_buckets)]++;
+        }
+    }, 1);
+
+    // merge the sketches into an open-addressed table of summed counts
+    size_t error = 0;
+    size_t num_entries = 0;
+    for (size_t block = 0; block < num_blocks; block++) {
+        error += sketches[block].decrements;
+        num_entries += sketches[block].size;
+    }
+    size_t table_size = 16;
+    while (table_size < 2 * num_entries)
+        table_size *= 2;
+    uint64_t table_mask = table_size - 1;
+    ensure_capacity(ws.unique_hashed_keys, table_size);
+    ensure_capacity(ws.counts, table_size);
+    auto &table_keys = ws.unique_hashed_keys;
+    auto &table_counts = ws.counts;
+    parallel_for(0, table_size, [&](size_t i) {
+        table_keys[i] = 0;
+        table_counts[i] = 0;
+    });
+    parallel_for(0, num_blocks, [&](size_t block) {
+        const HeavyHitterSketch &sketch = sketches[block];
+        parallel_for(0, sketch.table_mask + 1, [&](size_t s) {
+            uint64_t hashed_key = sketch.keys[s];
+            if (hashed_key == 0)
+                return;
+            size_t h = HeavyKeyTable<>::slot_hash(hashed_key) >> 32 & table_mask;
+            while (!bucket_cas(&table_keys[h], (uint64_t)0, hashed_key) && table_keys[h] != hashed_key)
+                h = (h + 1) & table_mask;
+            reinterpret_cast<std::atomic<uint64_t> *>(&table_counts[h])->fetch_add(sketch.counts[s], std::memory_order_relaxed);
+        });
+    }, 1);
+
+    // add heavy buckets
+    auto &heavy_key_buckets = ws.heavy_key_buckets;
+    ensure_capacity(heavy_key_buckets, table_size);
+    size_t num_heavy_buckets = parlay::filter_into_uninitialized(
+        parlay::delayed_seq<Bucket>(table_size, [&](size_t i) {
+            bool is_heavy = table_keys[i] != 0 && table_counts[i] + error > threshold;
+            Index bucket_size = is_heavy ? (Index)ceil(slack * (table_counts[i] + error)) : 0;
+            return Bucket{table_keys[i], 0, bucket_size, is_heavy};
+        }),
+        heavy_key_buckets,
+        [&](Bucket bucket) { return bucket.isHeavy; });
+
+    // records per light bucket, less the counted records of its heavy keys
+    ensure_capacity(ws.light_key_bucket_sample_counts, num_buckets);
+    auto &light_counts = ws.light_key_bucket_sample_counts;
+    parallel_for(0, num_buckets, [&](size_t i) {
+        Index count = 0;
+        for (size_t block = 0; block < num_blocks; block++)
+            count += block_counts[block * num_buckets + i];
+        light_counts[i] = count;
+    });
+    parallel_for(0, num_heavy_buckets, [&](size_t i) {
+        uint64_t hashed_key = heavy_key_buckets[i].bucket_id;
+        size_t h = HeavyKeyTable<>::slot_hash(hashed_key) >> 32 & table_mask;
+        while (table_keys[h] != hashed_key)
+            h = (h + 1) & table_mask;
+        reinterpret_cast<std::atomic<Index> *>(&light_counts[light_bucket_index(hashed_key, bucket_shift, num_buckets)])
+            ->fetch_sub((Index)table_counts[h], std::memory_order_relaxed);
+    });
+
+    return lay_out_buckets(ws, num_heavy_buckets, num_buckets, bucket_shift, [&](size_t i) {
+        return ceil(slack * light_counts[i]);
+    });
+}
+
+// Claim an empty slot of entry's bucket for rec: probe linearly from
+// insert_index, CAS the hashed key into the first empty slot, and restart at a
+// random slot when the probe runs off the end of the bucket
+template <class Object, class Key, class Index, class Rng>
+inline void insert_into_bucket(
+    parlay::sequence<record<Object, Key>> &buckets,
+    const BasicBucket<Index> &entry,
+    size_t insert_index,
+    const record<Object, Key> &rec,
+    Rng &r,
+    std::uniform_int_distribution<size_t> &dis,
+    ScatterCounters &counters)
+{
+    for (size_t probe_length = 1;; probe_length++) {
+        counters.probe();
+        record<Object, Key> c = buckets[insert_index];
+        if (c.isEmpty()) {
+            if (bucket_cas(&buckets[insert_index].hashed_key, (uint64_t)0, rec.hashed_key)) {
+                buckets[insert_index] = rec;
+                counters.placed(probe_length);
+                return;
+            }
+            counters.cas_failure();
+        }
+        insert_index++;
+        if (insert_index >= entry.offset + entry.size) {
+            insert_index = entry.offset + dis(r) % entry.size;
+            counters.wraparound();
+        }
+    }
+}
+
+// Insert every record i (or only those in heavy or light buckets) at a random
+// slot of its bucket bucket_of(i)
+template <class Object, class Key, class BucketOf>
 inline void scatter_keys(
     parlay::sequence<record<Object, Key>> &arr,
     parlay::sequence<record<Object, Key>> &buckets,
-    parlay::hashtable<hash_buckets> &hash_table,
-    uint32_t n,
+    BucketOf bucket_of,
+    size_t n,
     double logn,
-    uint32_t num_partitions,
-    uint64_t bucket_range,
+    size_t num_partitions,
     parlay::random_generator gen,
     std::uniform_int_distribution<size_t> dis,
-    bool isHeavy)
+    ScatterKeys keys,
+    SemisortStats *stats = nullptr)
 {
     parallel_for(0, num_partitions + 1, [&](size_t partition) {
-        uint32_t end_partition = (uint32_t)((partition + 1) * logn);
-        uint32_t end_state = (end_partition > n) ? n : end_partition;
-        for(uint32_t i = partition * logn; i < end_state; i++) {
-            Bucket entry;
-            if (isHeavy) {
-                entry = hash_table.find(arr[i].hashed_key);
-                if (entry == (Bucket){0, 0, 0, 0}) // continue if it is not a heavy key
-                    continue;
-            } else {
-                uint64_t rounded_down_key = round_down(arr[i].hashed_key, bucket_range);
-                if (hash_table.find(arr[i].hashed_key) != (Bucket){0, 0, 0, 0}) // perhaps we can remove this somehow
-                    continue;
-
-                entry = hash_table.find(rounded_down_key);
-                if (entry == (Bucket){0, 0, 0, 0})
-                    continue;
-            }
+        size_t end_partition = (size_t)((partition + 1) * logn);
+        size_t end_state = (end_partition > n) ? n : end_partition;
+        auto r = gen[partition];
+        ScatterCounters counters;
+        for(size_t i = partition * logn; i < end_state; i++) {
+            auto entry = bucket_of(i);
+            if ((entry.isHeavy && keys == ScatterKeys::Light) || (!entry.isHeavy && keys == ScatterKeys::Heavy))
+                continue;
 
-            auto r = gen[partition];
-            uint32_t insert_index = entry.offset + dis(r) % entry.size;
-            while (true) {
-                record<Object, Key> c = buckets[insert_index];
-                if (c.isEmpty()) {
-                    if (bucket_cas(&buckets[insert_index].hashed_key, (uint64_t)0, arr[i].hashed_key)) {
-                        buckets[insert_index] = arr[i];
-                        break;
-                    }
-                }
-                insert_index++;
-                if (insert_index >= entry.offset + entry.size) {
-                  insert_index = entry.offset + dis(r) % entry.size;
-                }
-            }
+            insert_into_bucket(buckets, entry, entry.offset + dis(r) % entry.size, arr[i], r, dis, counters);
         } 
+        counters.add_to(stats);
     });
 }
 
-template <class Object, class Key>
+// scatter_keys with the random writes pipelined. The bucket array is far larger
+// than the last level cache, so nearly every first probe misses the cache and
+// the TLB. Each task takes a large block of the input and picks the bucket and
+// first slot of the record prefetch_distance positions ahead, prefetching that
+// slot for writing, before probing the current record, so the misses of a
+// block overlap instead of stalling one after another.
+template <class Object, class Key, class BucketOf>
+inline void scatter_keys_prefetch(
+    parlay::sequence<record<Object, Key>> &arr,
+    parlay::sequence<record<Object, Key>> &buckets,
+    BucketOf bucket_of,
+    size_t n,
+    parlay::random_generator gen,
+    std::uniform_int_distribution<size_t> dis,
+    size_t prefetch_distance,
+    SemisortStats *stats = nullptr)
+{
+    using Bucket = std::decay_t<decltype(bucket_of(0))>;
+    const size_t max_prefetch_distance = 64;
+    assert(prefetch_distance > 0 && prefetch_distance <= max_prefetch_distance &&
+           (prefetch_distance & (prefetch_distance - 1)) == 0);
+    size_t num_blocks = max((size_t)1, min(8 * parlay::num_workers(), n / (16 * max_prefetch_distance)));
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+
+    parallel_for(0, num_blocks, [&](size_t block) {
+        size_t start_range = block * block_size;
+        size_t end_range = min(n, start_range + block_size);
+        auto r = gen[block];
+        ScatterCounters counters;
+
+        // ring of the buckets and first slots of the next prefetch_distance records
+        Bucket entries[max_prefetch_distance];
+        size_t first_slots[max_prefetch_distance];
+        auto pick_slot = [&](size_t i) {
+            size_t ring = (i - start_range) & (prefetch_distance - 1);
+            Bucket &entry = entries[ring];
+            entry = bucket_of(i);
+            first_slots[ring] = entry.offset + dis(r) % entry.size;
+            __builtin_prefetch(&buckets[first_slots[ring]], 1);
+        };
+        for (size_t i = start_range; i < min(end_range, start_range + prefetch_distance); i++)
+            pick_slot(i);
+
+        for (size_t i = start_range; i < end_range; i++) {
+            size_t ring = (i - start_range) & (prefetch_distance - 1);
+            Bucket entry = entries[ring];
+            size_t insert_index = first_slots[ring];
+            if (i + prefetch_distance < end_range)
+                pick_slot(i + prefetch_distance);
+
+            insert_into_bucket(buckets, entry, insert_index, arr[i], r, dis, counters);
+        }
+        counters.add_to(stats);
+    }, 1);
+}
+
+// scatter_keys with the writes grouped by destination. The bucket array is cut
+// into regions of about region_bytes, sized to what the TLB maps, and every
+// worker keeps a staging block of block_bytes per region for the records whose
+// first probe falls there. Records are copied into the blocks with their first
+// slot and bucket range, so a flush reads only its block: the first slots are
+// prefetched together and the records inserted, writing to one region instead
+// of all over the array. Blocks are emptied at the end of every input block,
+// and a block never moves between workers as it runs nothing in parallel.
+template <class Object, class Key, class Index, class BucketOf>
+inline void scatter_keys_staged(
+    parlay::sequence<record<Object, Key>> &arr,
+    SemisortWorkspace<Object, Key, Index> &ws,
+    BucketOf bucket_of,
+    size_t n,
+    parlay::random_generator gen,
+    std::uniform_int_distribution<size_t> dis,
+    size_t block_bytes,
+    size_t region_bytes,
+    SemisortStats *stats = nullptr)
+{
+    using Staged = StagedRecord<Object, Key, Index>;
+    auto &buckets = ws.buckets;
+    size_t capacity = max((size_t)1, block_bytes / sizeof(Staged));
+    uint32_t region_shift = 0;
+    while ((sizeof(record<Object, Key>) << (region_shift + 1)) <= region_bytes)
+        region_shift++;
+    size_t num_regions = ((ws.buckets_size - 1) >> region_shift) + 1;
+
+    // staging_counts only grows zeroed and is left zeroed by every block
+    size_t num_workers = parlay::num_workers();
+    ensure_capacity(ws.staging, num_workers * num_regions * capacity);
+    ensure_capacity(ws.staging_counts, num_workers * num_regions);
+    size_t num_blocks = max((size_t)1, min(8 * num_workers, n / (num_regions * capacity)));
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+
+    parallel_for(0, num_blocks, [&](size_t block) {
+        size_t worker = parlay::worker_id();
+        Staged *staging = ws.staging.data() + worker * num_regions * capacity;
+        uint32_t *counts = ws.staging_counts.data() + worker * num_regions;
+        auto r = gen[block];
+        ScatterCounters counters;
+
+        auto flush = [&](size_t region) {
+            Staged *staged = staging + region * capacity;
+            for (size_t k = 0; k < counts[region]; k++)
+                __builtin_prefetch(&buckets[staged[k].first_slot], 1);
+            for (size_t k = 0; k < counts[region]; k++) {
+                BasicBucket<Index> entry{};
+                entry.offset = staged[k].bucket_offset;
+                entry.size = staged[k].bucket_size;
+                insert_into_bucket(buckets, entry, staged[k].first_slot, staged[k].rec, r, dis, counters);
+            }
+            counts[region] = 0;
+        };
+        size_t end_range = min(n, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end_range; i++) {
+            auto entry = bucket_of(i);
+            size_t first_slot = entry.offset + dis(r) % entry.size;
+            size_t region = first_slot >> region_shift;
+            staging[region * capacity + counts[region]++] = {arr[i], (Index)first_slot, entry.offset, entry.size};
+            if (counts[region] == capacity)
+                flush(region);
+        }
+        for (size_t region = 0; region < num_regions; region++)
+            if (counts[region] > 0)
+                flush(region);
+        counters.add_to(stats);
+    }, 1);
+}
+
+// NumaPlacement::Local scatter: the input is partitioned once by the node whose
+// slice of the bucket array holds each record's bucket (its first slot), block
+// by block as in scatter_keys_counting, so node k's records of a block lie
+// together in input order. The tasks running on node k then insert node k's
+// records first. Each record is written by a worker of its bucket's node unless
+// that node runs out of blocks before the others.
+template <class Object, class Key, class Index, class BucketOf>
+inline void scatter_keys_numa(
+    parlay::sequence<record<Object, Key>> &arr,
+    SemisortWorkspace<Object, Key, Index> &ws,
+    BucketOf bucket_of,
+    size_t n,
+    parlay::random_generator gen,
+    std::uniform_int_distribution<size_t> dis,
+    SemisortStats *stats = nullptr)
+{
+    size_t num_nodes = semisort_numa_nodes();
+    auto &buckets = ws.buckets;
+
+    const size_t block_size = 1 << 12;
+    size_t num_blocks = (n + block_size - 1) / block_size;
+    ensure_capacity(ws.record_nodes, n);
+    ensure_capacity(ws.node_order, n);
+    ensure_capacity(ws.block_counts, num_nodes * num_blocks);
+    auto &record_nodes = ws.record_nodes;
+    auto &node_order = ws.node_order;
+    auto &block_counts = ws.block_counts;
+
+    // tag every record with its node and count each node's records per block
+    parallel_for(0, num_blocks, [&](size_t block) {
+        size_t end = min(n, (block + 1) * block_size);
+        for (size_t node = 0; node < num_nodes; node++)
+            block_counts[node * num_blocks + block] = 0;
+        for (size_t i = block * block_size; i < end; i++) {
+            size_t node = bucket_node(bucket_of(i).offset, ws.bucket_node_span, num_nodes);
+            record_nodes[i] = (uint8_t)node;
+            block_counts[node * num_blocks + block]++;
+        }
+    }, 1);
+
+    // node-major offsets; writing advances each to the end of its range, which
+    // is where the next range starts
+    parlay::scan_inplace(block_counts.cut(0, num_nodes * num_blocks));
+    parallel_for(0, num_blocks, [&](size_t block) {
+        size_t end = min(n, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end; i++)
+            node_order[block_counts[record_nodes[i] * num_blocks + block]++] = (Index)i;
+    }, 1);
+
+    for_each_node_chunk(num_nodes, num_blocks, [&](size_t node, size_t block) {
+        size_t range = node * num_blocks + block;
+        auto r = gen[range];
+        auto block_dis = dis;
+        ScatterCounters counters;
+        for (size_t j = (range == 0) ? 0 : block_counts[range - 1]; j < block_counts[range]; j++) {
+            size_t i = node_order[j];
+            auto entry = bucket_of(i);
+            insert_into_bucket(buckets, entry, entry.offset + block_dis(r) % entry.size, arr[i], r, block_dis, counters);
+        }
+        counters.add_to(stats);
+    });
+}
+
+// Deterministic alternative to scatter_keys. Every block of the input counts its
+// records per bucket, a scan over the bucket-major counts gives each block its
+// own range inside every bucket, and a second pass writes the records there
+// without contention. Buckets come out exactly sized with no empty slots, and
+// the heavy and light descriptors are rewritten to the new ranges. Blocks are
+// consecutive and take their ranges of a bucket in block order, so every
+// bucket holds its records in input order, which SemisortConfig::stable uses.
+// With bucket_ids_set the bucket numbers are already in ws.bucket_ids.
+template <class Object, class Key, class Index>
+inline void scatter_keys_counting(
+    parlay::sequence<record<Object, Key>> &arr,
+    SemisortWorkspace<Object, Key, Index> &ws,
+    size_t num_buckets,
+    uint32_t bucket_shift,
+    size_t n,
+    bool bucket_ids_set = false)
+{
+    size_t num_heavy_buckets = ws.num_heavy_buckets;
+    size_t num_all_buckets = num_heavy_buckets + num_buckets;
+    // a few blocks per worker, but no more than about n counts in total
+    size_t num_blocks = max((size_t)1, min(4 * parlay::num_workers(), n / num_all_buckets));
+    size_t block_size = (n + num_blocks - 1) / num_blocks;
+
+    ensure_capacity(ws.bucket_ids, n);
+    ensure_capacity(ws.block_counts, num_all_buckets * num_blocks);
+    auto &bucket_ids = ws.bucket_ids;
+    auto &block_counts = ws.block_counts;
+    auto &buckets = ws.buckets;
+    parallel_for(0, num_all_buckets * num_blocks, [&](size_t i) {
+        block_counts[i] = 0;
+    });
+
+    // heavy buckets are numbered first, then the light buckets
+    parallel_for(0, num_blocks, [&](size_t block) {
+        size_t end_range = min(n, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end_range; i++) {
+            if (!bucket_ids_set)
+                bucket_ids[i] = bucket_number(ws, arr[i].hashed_key, bucket_shift, num_buckets);
+            block_counts[bucket_ids[i] * num_blocks + block]++;
+        }
+    }, 1);
+    parlay::scan_inplace(block_counts.cut(0, num_all_buckets * num_blocks));
+
+    parallel_for(0, num_blocks, [&](size_t block) {
+        size_t end_range = min(n, (block + 1) * block_size);
+        for (size_t i = block * block_size; i < end_range; i++)
+            buckets[block_counts[bucket_ids[i] * num_blocks + block]++] = arr[i];
+    }, 1);
+
+    // block_counts now holds the end of every (bucket, block) range
+    parallel_for(0, num_all_buckets, [&](size_t b) {
+        Index start_range = (b == 0) ? 0 : block_counts[b * num_blocks - 1];
+        Index end_range = block_counts[(b + 1) * num_blocks - 1];
+        BasicBucket<Index> &bucket = (b < num_heavy_buckets) ? ws.heavy_key_buckets[b] : ws.light_buckets[b - num_heavy_buckets];
+        bucket.offset = start_range;
+        bucket.size = end_range - start_range;
+    });
+}
+
+// Sort the packed records of one light bucket by hashed key without allocating.
+// An in-place counting sort on the top bits of (hashed_key - min_key) splits the
+// records into about num_records / 4 digits; hashed keys are uniform, so every
+// digit holds a handful of records and is finished with an insertion sort.
+template <class Slice>
+inline void radix_sort_light_bucket(Slice records, uint64_t min_key, uint64_t max_key)
+{
+    const uint32_t max_radix_bits = 11;
+    const size_t insertion_sort_max = 64;
+    size_t num_records = records.size();
+    auto light_key_comparison = [&](const auto &a, const auto &b)
+    { return a.hashed_key < b.hashed_key; };
+    auto small_sort = [&](size_t start_range, size_t end_range) {
+        if (end_range - start_range > insertion_sort_max) {
+            std::sort(records.begin() + start_range, records.begin() + end_range, light_key_comparison);
+            return;
+        }
+        for (size_t j = start_range + 1; j < end_range; j++) {
+            auto current = records[j];
+            size_t k = j;
+            for (; k > start_range && current.hashed_key < records[k - 1].hashed_key; k--)
+                records[k] = records[k - 1];
+            records[k] = current;
+        }
+    };
+    if (max_key == min_key)
+        return;
+    if (num_records <= insertion_sort_max) {
+        small_sort(0, num_records);
+        return;
+    }
+
+    uint32_t key_bits = 64 - __builtin_clzll(max_key - min_key);
+    uint32_t radix_bits = min(max_radix_bits, (uint32_t)(64 - __builtin_clzll(num_records)) - 2);
+    uint32_t shift = (key_bits > radix_bits) ? key_bits - radix_bits : 0;
+    size_t num_digits = ((max_key - min_key) >> shift) + 1;
+    auto digit = [&](uint64_t hashed_key) { return (hashed_key - min_key) >> shift; };
+
+    uint32_t next[1 << max_radix_bits];
+    uint32_t digit_end[1 << max_radix_bits];
+    for (size_t d = 0; d < num_digits; d++)
+        digit_end[d] = 0;
+    for (size_t j = 0; j < num_records; j++)
+        digit_end[digit(records[j].hashed_key)]++;
+    uint32_t digit_start = 0;
+    for (size_t d = 0; d < num_digits; d++) {
+        next[d] = digit_start;
+        digit_start += digit_end[d];
+        digit_end[d] = digit_start;
+    }
+
+    // cycle every record into its digit
+    for (size_t d = 0; d < num_digits; d++) {
+        while (next[d] < digit_end[d]) {
+            auto current = records[next[d]];
+            size_t current_digit = digit(current.hashed_key);
+            while (current_digit != d) {
+                std::swap(current, records[next[current_digit]++]);
+                current_digit = digit(current.hashed_key);
+            }
+            records[next[d]++] = current;
+        }
+    }
+
+    for (size_t d = 0; d < num_digits; d++)
+        small_sort((d == 0) ? 0 : digit_end[d - 1], digit_end[d]);
+}
+
+// Step 7b, 7c: pack the records of every light bucket to its front, clear the
+// slots behind them, record how many there are in light_counts and sort the
+// records by hashed key. Buckets holding at least
+// comparison_sort_min records, which only happens when sampling missed a heavy
+// key, fall back to a parallel comparison sort. With stable the records keep
+// their order in the bucket among equal keys, and comparison sorts replace the
+// radix sort, whose cycles move records past equal ones.
+template <class Object, class Key, class Index>
 inline void sort_light_buckets(
     parlay::sequence<record<Object, Key>> &buckets,
-    parlay::sequence<Bucket> &light_buckets,
-    uint32_t n,
-    uint32_t num_buckets)
+    parlay::sequence<BasicBucket<Index>> &light_buckets,
+    parlay::sequence<Index> &light_counts,
+    size_t num_buckets,
+    size_t comparison_sort_min,
+    bool stable = false)
 {
-    auto light_key_filter = [&](record<Object, Key> x)
-    { return x.hashed_key != 0; };
     auto light_key_comparison = [&](record<Object, Key> a, record<Object, Key> b)
     { return a.hashed_key < b.hashed_key; };
     parallel_for(0, num_buckets, [&](size_t i) {
-        // sort here
-        uint32_t start_range = light_buckets[i].offset;
-        uint32_t end_range = light_buckets[i].offset + light_buckets[i].size;
-        parlay::sort_inplace(buckets.cut(start_range, end_range), light_key_comparison); // sort light buckets
-
-        auto out_cut = buckets.cut(start_range, end_range); // is this packing correct?
-        parlay::sequence<record<Object, Key>> filtered = parlay::filter(
-            buckets.cut(start_range, end_range),
-            light_key_filter
-        ); 
-        parallel_for(start_range, end_range, [&](size_t j) {
-            if (j - start_range < filtered.size()) {
-                buckets[j] = filtered[j-start_range];
-            } else{
-                buckets[j] = (record<Object, Key>){};
-                buckets[j].hashed_key = 0;
+        size_t start_range = light_buckets[i].offset;
+        size_t end_range = start_range + light_buckets[i].size;
+
+        size_t num_records = 0;
+        uint64_t min_key = UINT64_MAX;
+        uint64_t max_key = 0;
+        for (size_t j = start_range; j < end_range; j++) {
+            if (buckets[j].isEmpty())
+                continue;
+            min_key = min(min_key, (uint64_t)buckets[j].hashed_key);
+            max_key = max(max_key, (uint64_t)buckets[j].hashed_key);
+            if (j != start_range + num_records)
+                buckets[start_range + num_records] = buckets[j];
+            num_records++;
+        }
+        for (size_t j = start_range + num_records; j < end_range; j++)
+            buckets[j].hashed_key = 0;
+        light_counts[i] = num_records;
+
+        auto records = buckets.cut(start_range, start_range + num_records);
+        if (stable && num_records >= comparison_sort_min)
+            parlay::stable_sort_inplace(records, light_key_comparison);
+        else if (stable && num_records > 1)
+            std::stable_sort(records.begin(), records.end(), light_key_comparison);
+        else if (num_records >= comparison_sort_min)
+            parlay::sort_inplace(records, light_key_comparison);
+        else if (num_records > 1)
+            radix_sort_light_bucket(records, min_key, max_key);
+    });
+}
+
+template <class T, class = void>
+struct is_less_comparable : std::false_type {};
+
+template <class T>
+struct is_less_comparable<T, std::void_t<decltype(std::declval<const T &>() < std::declval<const T &>())>>
+    : std::true_type {};
+
+// Groups are formed by hashed key, so keys that collide share a group. Split
+// every such group of items (group g is items[group_offsets[g], next offset),
+// the last ending at items.size()) into one group per distinct key_of(item),
+// keeping the items of each key in their order, and return the new offsets.
+// Collisions are rare: groups are checked in parallel and only mixed ones are
+// stable sorted by key, or for keys without operator< partitioned by moving
+// the items equal to the first remaining key forward.
+template <class Seq, class Index, class KeyOf>
+parlay::sequence<Index> split_collided_groups(
+    Seq &items,
+    const parlay::sequence<Index> &group_offsets,
+    KeyOf key_of)
+{
+    size_t n = items.size();
+    size_t num_groups = group_offsets.size();
+    auto group_end = [&](size_t g) -> size_t { return (g + 1 < num_groups) ? group_offsets[g + 1] : n; };
+    auto num_keys = parlay::tabulate(num_groups, [&](size_t g) -> Index {
+        auto start = items.begin() + group_offsets[g];
+        auto end = items.begin() + group_end(g);
+        auto first = key_of(*start);
+        if (std::all_of(start + 1, end, [&](const auto &item) { return key_of(item) == first; }))
+            return 1;
+        Index count = 0;
+        if constexpr (is_less_comparable<decltype(first)>::value) {
+            std::stable_sort(start, end, [&](const auto &a, const auto &b) { return key_of(a) < key_of(b); });
+            for (auto it = start; it != end; ++it)
+                count += (it == start || !(key_of(*it) == key_of(*(it - 1))));
+        } else {
+            while (start != end) {
+                auto key = key_of(*start);
+                start = std::stable_partition(start, end, [&](const auto &item) { return key_of(item) == key; });
+                count++;
             }
-        }); 
+        }
+        return count;
+    });
+    size_t total_keys = parlay::scan_inplace(num_keys);
+    if (total_keys == num_groups)
+        return group_offsets;
+
+    // mixed groups now hold their keys in runs, one new group per run
+    parlay::sequence<Index> offsets(total_keys);
+    parallel_for(0, num_groups, [&](size_t g) {
+        size_t out = num_keys[g];
+        size_t start = group_offsets[g];
+        offsets[out++] = start;
+        size_t end_out = (g + 1 < num_groups) ? num_keys[g + 1] : total_keys;
+        for (size_t j = start + 1; out < end_out; j++)
+            if (!(key_of(items[j]) == key_of(items[j - 1])))
+                offsets[out++] = j;
     });
+    return offsets;
 }
 
-template <class Object, class Key>
+// Records per pack chunk: enough chunks for every worker to get several, but
+// none smaller than min_chunk_bytes so each chunk streams through cache well
+inline size_t pack_chunk_length(size_t size, size_t record_bytes, size_t min_chunk_bytes)
+{
+    size_t num_chunks = 8 * parlay::num_workers();
+    size_t chunk_length = (size + num_chunks - 1) / num_chunks;
+    return max(chunk_length, max(min_chunk_bytes / record_bytes, (size_t)1));
+}
+
+// Step 8: move the records left in the buckets to arr. The heavy buckets are
+// laid out first; that region is cut into chunks which count their records.
+// Light buckets were already packed by sort_light_buckets, so their counts are
+// known and their empty slots are not read again. A parallel scan over the chunk
+// and light bucket counts gives every segment its place in arr.
+template <class Object, class Key, class Index>
 inline void pack_elements(
     parlay::sequence<record<Object, Key>> &arr,
-    parlay::sequence<record<Object, Key>> &buckets,
-    uint32_t buckets_size)
+    SemisortWorkspace<Object, Key, Index> &ws,
+    size_t min_chunk_bytes)
 {
-    uint32_t num_partitions_step8 = min((uint32_t)1000, (uint32_t)buckets_size);
-    parlay::sequence<int> interval_length(num_partitions_step8);
-    parlay::sequence<int> interval_prefix_sum(num_partitions_step8);
-    parallel_for(0, num_partitions_step8 + 1, [&](size_t partition) { // leq or lt?
-        uint32_t chunk_length = ceil((double)buckets_size / num_partitions_step8);
-        uint32_t start_range = chunk_length * partition;
-        uint32_t cur_chunk_pointer = 0;
-
-        for (uint32_t i = 0; i < chunk_length; i++)
-        {
-            if (start_range + i >= buckets_size)
-                break;
-            if (buckets[start_range + i].hashed_key != 0)
-            {
-                buckets[start_range + cur_chunk_pointer] = buckets[start_range + i];
-                cur_chunk_pointer++;
-            }
+    auto &buckets = ws.buckets;
+    auto &light_buckets = ws.light_buckets;
+    auto &light_counts = ws.light_counts;
+    size_t num_light_buckets = ws.num_light_buckets;
+    size_t heavy_end = light_buckets[0].offset;
+    size_t chunk_length = pack_chunk_length(heavy_end, sizeof(record<Object, Key>), min_chunk_bytes);
+    size_t num_chunks = (heavy_end + chunk_length - 1) / chunk_length;
+    size_t num_segments = num_chunks + num_light_buckets;
+
+    ensure_capacity(ws.segment_offsets, num_segments);
+    auto &segment_offsets = ws.segment_offsets;
+    parallel_for(0, num_segments, [&](size_t s) {
+        if (s >= num_chunks) {
+            segment_offsets[s] = light_counts[s - num_chunks];
+            return;
         }
-        interval_length[partition] = cur_chunk_pointer;
+        size_t start_range = s * chunk_length;
+        size_t end_range = min(heavy_end, start_range + chunk_length);
+        Index num_records = 0;
+        for (size_t j = start_range; j < end_range; j++)
+            num_records += !buckets[j].isEmpty();
+        segment_offsets[s] = num_records;
     });
+    size_t num_packed = parlay::scan_inplace(segment_offsets.cut(0, num_segments));
+    assert(num_packed == arr.size());
+    (void)num_packed;
 
-#ifdef DEBUG
-    cout << "bucket after pack" << endl;
-    for (uint32_t i = 0; i < buckets_size; i++)
-    {
-        cout << i << " " << buckets[i].obj << " " << buckets[i].key << " " << buckets[i].hashed_key << endl;
-    }
-#endif
-
-    for (uint32_t i = 1; i < num_partitions_step8; i++)
-    {
-        interval_prefix_sum[i] = interval_length[i - 1] + interval_prefix_sum[i - 1];
-    }
+    parallel_for(0, num_segments, [&](size_t s) {
+        size_t out = segment_offsets[s];
+        if (s >= num_chunks) {
+            size_t start_range = light_buckets[s - num_chunks].offset;
+            for (size_t j = 0; j < light_counts[s - num_chunks]; j++)
+                arr[out + j] = buckets[start_range + j];
+            return;
+        }
+        size_t start_range = s * chunk_length;
+        size_t end_range = min(heavy_end, start_range + chunk_length);
+        for (size_t j = start_range; j < end_range; j++)
+            if (!buckets[j].isEmpty())
+                arr[out++] = buckets[j];
+    });
 
 #ifdef DEBUG
-    cout << "interval_prefix_sum" << endl;
-    for (uint32_t i = 0; i < num_partitions_step8; i++)
+    cout << "segment offsets" << endl;
+    for (size_t i = 0; i < num_segments; i++)
     {
-        cout << interval_prefix_sum[i] << " ";
+        cout << segment_offsets[i] << " ";
     }
     cout << endl;
 #endif
-
-    parallel_for(0, num_partitions_step8, [&](size_t partition) {
-        uint32_t chunk_length = ceil((double)buckets_size / num_partitions_step8);
-        uint32_t start_range = interval_prefix_sum[partition];
-        for(uint32_t i = 0; i < interval_length[partition]; i++) {
-            arr[start_range + i] = buckets[chunk_length * partition + i];
-        } 
-    });
-}
\ No newline at end of file
+}
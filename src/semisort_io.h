@@ -0,0 +1,186 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "semisort_types.h"
+
+// Input layouts the driver reads
+enum class InputFormat
+{
+    // native endian uint64_t keys, back to back
+    BinaryKeys,
+    // native endian (uint64_t key, uint64_t payload) pairs
+    BinaryPairs,
+    // one decimal key per line; lines not starting with a digit (headers such
+    // as the "sequenceInt" line of the zipfDistSeq files) are skipped
+    TextKeys
+};
+
+// A whole file mapped read only (or read write for output). The mapping is the
+// only copy of the bytes: loaders build records straight from it.
+struct MappedFile
+{
+    char *data = nullptr;
+    size_t size = 0;
+
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&other) : data(other.data), size(other.size)
+    {
+        other.data = nullptr;
+        other.size = 0;
+    }
+
+    // map path for reading; every loader thread reads its range front to back
+    static MappedFile open_read(const std::string &path)
+    {
+        MappedFile file;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + path);
+        struct stat st;
+        fstat(fd, &st);
+        file.map(fd, st.st_size, PROT_READ, path);
+        if (file.size > 0)
+            madvise(file.data, file.size, MADV_SEQUENTIAL);
+        return file;
+    }
+
+    // create or truncate path to size bytes and map it for writing
+    static MappedFile create(const std::string &path, size_t size)
+    {
+        MappedFile file;
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("cannot create " + path);
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            throw std::runtime_error("cannot resize " + path);
+        }
+        file.map(fd, size, PROT_READ | PROT_WRITE, path);
+        return file;
+    }
+
+    ~MappedFile()
+    {
+        if (size > 0)
+            munmap(data, size);
+    }
+
+private:
+    void map(int fd, size_t length, int protection, const std::string &path)
+    {
+        if (length > 0) {
+            void *addr = mmap(nullptr, length, protection, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("cannot map " + path);
+            }
+            data = static_cast<char *>(addr);
+            size = length;
+        }
+        // the mapping keeps the file alive
+        close(fd);
+    }
+};
+
+// parse the decimal number starting at p, stopping at the first non digit
+inline uint64_t parse_decimal(const char *&p, const char *end)
+{
+    uint64_t value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (uint64_t)(*p++ - '0');
+    return value;
+}
+
+// Parse one key per line in parallel. The text is cut into chunks that start
+// right after a newline; every chunk counts its keys, a scan gives each chunk
+// its output offset, and a second pass parses the keys into place: allocate(n)
+// is called once with the number of keys, then store(i, key) for every key.
+template <class Allocate, class Store>
+inline size_t parse_text_keys(const char *data, size_t size, Allocate allocate, Store store, size_t chunk_bytes = 1 << 20)
+{
+    size_t num_chunks = (size + chunk_bytes - 1) / chunk_bytes;
+    auto chunk_start = [&](size_t c) -> size_t {
+        if (c == 0)
+            return 0;
+        if (c >= num_chunks)
+            return size;
+        const void *newline = memchr(data + c * chunk_bytes - 1, '\n', size - c * chunk_bytes + 1);
+        return newline == nullptr ? size : static_cast<const char *>(newline) - data + 1;
+    };
+    auto for_each_key = [&](size_t c, auto f) {
+        const char *p = data + chunk_start(c);
+        const char *end = data + chunk_start(c + 1);
+        while (p < end) {
+            if (*p >= '0' && *p <= '9')
+                f(parse_decimal(p, end));
+            const void *newline = memchr(p, '\n', end - p);
+            p = newline == nullptr ? end : static_cast<const char *>(newline) + 1;
+        }
+    };
+
+    parlay::sequence<size_t> offsets(num_chunks, 0);
+    parlay::parallel_for(0, num_chunks, [&](size_t c) {
+        size_t count = 0;
+        for_each_key(c, [&](uint64_t) { count++; });
+        offsets[c] = count;
+    }, 1);
+    size_t num_keys = parlay::scan_inplace(offsets.cut(0, num_chunks));
+    allocate(num_keys);
+    parlay::parallel_for(0, num_chunks, [&](size_t c) {
+        size_t i = offsets[c];
+        for_each_key(c, [&](uint64_t key) { store(i++, key); });
+    }, 1);
+    return num_keys;
+}
+
+// Load path into (payload, key) records with hashed_key left 0; key only inputs
+// get the key's position as payload. The records are written straight from
+// the mapping, so the file is read exactly once.
+inline parlay::sequence<record<uint64_t, uint64_t>> load_records(const std::string &path, InputFormat format)
+{
+    using Record = record<uint64_t, uint64_t>;
+    MappedFile file = MappedFile::open_read(path);
+    parlay::sequence<Record> records;
+
+    if (format == InputFormat::TextKeys) {
+        parse_text_keys(
+            file.data, file.size,
+            [&](size_t n) { records = parlay::sequence<Record>::uninitialized(n); },
+            [&](size_t i, uint64_t key) { records[i] = {i, key, 0}; });
+        return records;
+    }
+
+    const uint64_t *words = reinterpret_cast<const uint64_t *>(file.data);
+    size_t stride = (format == InputFormat::BinaryPairs) ? 2 : 1;
+    size_t n = file.size / (stride * sizeof(uint64_t));
+    records = parlay::sequence<Record>::uninitialized(n);
+    parlay::parallel_for(0, n, [&](size_t i) {
+        uint64_t key = words[i * stride];
+        uint64_t payload = (stride == 2) ? words[i * stride + 1] : i;
+        records[i] = {payload, key, 0};
+    });
+    return records;
+}
+
+// Write the records in order through a writable mapping: keys only for
+// BinaryKeys and TextKeys inputs, (key, payload) pairs for BinaryPairs
+inline void write_records(const std::string &path, const parlay::sequence<record<uint64_t, uint64_t>> &records, InputFormat format)
+{
+    size_t stride = (format == InputFormat::BinaryPairs) ? 2 : 1;
+    MappedFile file = MappedFile::create(path, records.size() * stride * sizeof(uint64_t));
+    uint64_t *words = reinterpret_cast<uint64_t *>(file.data);
+    parlay::parallel_for(0, records.size(), [&](size_t i) {
+        words[i * stride] = records[i].key;
+        if (stride == 2)
+            words[i * stride + 1] = records[i].obj;
+    });
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+#ifdef SEMISORT_NUMA
+#include <numa.h>
+#endif
+
+#include "semisort_types.h"
+
+// NUMA nodes of the machine, 1 without libnuma
+inline size_t semisort_numa_nodes()
+{
+#ifdef SEMISORT_NUMA
+    static const size_t nodes = (numa_available() < 0) ? 1 : (size_t)std::max(1, numa_num_configured_nodes());
+    return nodes;
+#else
+    return 1;
+#endif
+}
+
+// node of the cpu the calling worker runs on right now
+inline size_t current_numa_node()
+{
+#ifdef SEMISORT_NUMA
+    if (semisort_numa_nodes() > 1) {
+        int node = numa_node_of_cpu(sched_getcpu());
+        return node < 0 ? 0 : (size_t)node % semisort_numa_nodes();
+    }
+#endif
+    return 0;
+}
+
+// Call work(node, chunk) once for every chunk < num_chunks of every node.
+// parlay cannot pin tasks to sockets, so each task asks which node it runs on,
+// takes that node's chunks first and then helps the others.
+template <class Work>
+inline void for_each_node_chunk(size_t num_nodes, size_t num_chunks, Work work)
+{
+    std::unique_ptr<std::atomic<size_t>[]> next(new std::atomic<size_t>[num_nodes]);
+    for (size_t node = 0; node < num_nodes; node++)
+        next[node] = 0;
+    parlay::parallel_for(0, parlay::num_workers(), [&](size_t) {
+        size_t home = current_numa_node();
+        for (size_t k = 0; k < num_nodes; k++) {
+            size_t node = (home + k) % num_nodes;
+            size_t chunk;
+            while ((chunk = next[node].fetch_add(1, std::memory_order_relaxed)) < num_chunks)
+                work(node, chunk);
+        }
+    }, 1);
+}
+
+// node of the slice of a Local bucket array that slot offset falls in
+inline size_t bucket_node(size_t offset, size_t node_span, size_t num_nodes)
+{
+    return std::min(offset / node_span, num_nodes - 1);
+}
+
+// Place node k's slice of the first size slots of a Local bucket array on node
+// k: each node's workers zero its slice, so its pages fault in there. Slices
+// are a whole number of pages so that nodes share no page. Any pages already
+// backing the array are dropped first: every slot is empty when this runs, and
+// a dropped page reads back as zero, which is empty too.
+template <class Record>
+inline size_t place_local_slices(Record *slots, size_t capacity, size_t size, bool drop_pages)
+{
+    size_t num_nodes = semisort_numa_nodes();
+    const size_t chunk_records = 1 << 16;
+    size_t page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+    size_t page_records = std::max((size_t)1, page_bytes / sizeof(Record));
+    size_t span = (std::max(size, (size_t)1) + num_nodes - 1) / num_nodes;
+    span = (span + page_records - 1) / page_records * page_records;
+    if (drop_pages) {
+        // only the pages wholly inside the array
+        uintptr_t first = ((uintptr_t)slots + page_bytes - 1) / page_bytes * page_bytes;
+        uintptr_t last = ((uintptr_t)(slots + capacity)) / page_bytes * page_bytes;
+        if (first < last)
+            madvise((void *)first, last - first, MADV_DONTNEED);
+    }
+    size_t chunks_per_node = (span + chunk_records - 1) / chunk_records;
+    for_each_node_chunk(num_nodes, chunks_per_node, [&](size_t node, size_t c) {
+        size_t start = std::min(capacity, node * span + c * chunk_records);
+        size_t end = std::min({capacity, (node + 1) * span, start + chunk_records});
+        memset((void *)(slots + start), 0, (end - start) * sizeof(Record));
+    });
+    return span;
+}
+
+// Grow ws.buckets to size empty slots placed as asked. Naive is ensure_capacity.
+// The others allocate without touching and zero the slots themselves, so each
+// page lands where its first write says: an interleave policy is set first, or
+// with Local every node's workers zero their node's slice of the current
+// layout. A Local array reused for a layout of another size is placed again,
+// since the slices follow size rather than the capacity.
+template <class Object, class Key, class Index>
+inline void ensure_bucket_capacity(SemisortWorkspace<Object, Key, Index> &ws, size_t size, NumaPlacement placement)
+{
+    using Record = record<Object, Key>;
+    if (!std::is_trivially_copyable<Record>::value || semisort_numa_nodes() == 1)
+        placement = NumaPlacement::Naive;
+    if (ws.bucket_placement == placement && ws.buckets.size() >= size) {
+        if constexpr (std::is_trivially_copyable<Record>::value) {
+            if (placement == NumaPlacement::Local && ws.bucket_node_size != size) {
+                ws.bucket_node_span = place_local_slices(ws.buckets.data(), ws.buckets.size(), size, true);
+                ws.bucket_node_size = size;
+            }
+        }
+        return;
+    }
+    if (placement == NumaPlacement::Naive) {
+        if (ws.bucket_placement != placement)
+            ws.buckets = parlay::sequence<Record>();
+        ensure_capacity(ws.buckets, size);
+        ws.bucket_placement = placement;
+        return;
+    }
+
+    if constexpr (std::is_trivially_copyable<Record>::value) {
+        size_t capacity = std::max(size, 2 * ws.buckets.size());
+        ws.buckets = parlay::sequence<Record>();
+        ws.buckets = parlay::sequence<Record>::uninitialized(capacity);
+        Record *slots = ws.buckets.data();
+#ifdef SEMISORT_NUMA
+        if (placement == NumaPlacement::Interleave)
+            numa_interleave_memory(slots, capacity * sizeof(Record), numa_all_nodes_ptr);
+#endif
+        if (placement == NumaPlacement::Interleave) {
+            const size_t chunk_records = 1 << 16;
+            parlay::parallel_for(0, (capacity + chunk_records - 1) / chunk_records, [&](size_t c) {
+                size_t start = c * chunk_records;
+                memset((void *)(slots + start), 0, std::min(chunk_records, capacity - start) * sizeof(Record));
+            }, 1);
+        } else {
+            // slots past the current layout are zeroed as well, wherever they land
+            size_t span = place_local_slices(slots, capacity, size, false);
+            size_t placed = std::min(capacity, semisort_numa_nodes() * span);
+            memset((void *)(slots + placed), 0, (capacity - placed) * sizeof(Record));
+            ws.bucket_node_span = span;
+            ws.bucket_node_size = size;
+        }
+        ws.bucket_placement = placement;
+    }
+}
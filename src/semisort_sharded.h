@@ -0,0 +1,355 @@
+#pragma once
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+#include "semisort_header.h"
+
+// Where the time of one semi_sort_sharded call went
+struct ShardedSemisortStats
+{
+    size_t num_workers;
+    size_t num_heavy_keys;
+    size_t largest_shard;    // light records one worker semisorted
+    double sample_seconds;   // local samples and the coordinator's bucket layout
+    double exchange_seconds; // counting and writing records to their owners
+    double sort_seconds;     // slowest local semisort
+};
+
+// Hands out 64 byte aligned arrays from one block; with base == nullptr it
+// only adds up the size the block needs
+struct SharedArena
+{
+    char *base;
+    size_t used = 0;
+
+    template <class T>
+    T *take(size_t count)
+    {
+        used = (used + 63) & ~(size_t)63;
+        T *p = reinterpret_cast<T *>(base + used);
+        used += count * sizeof(T);
+        return p;
+    }
+};
+
+// threads parlay starts in a process, found without starting it
+inline size_t shard_total_threads()
+{
+    const char *threads = getenv("PARLAY_NUM_THREADS");
+    size_t count = (threads != nullptr) ? strtoul(threads, nullptr, 10) : std::thread::hardware_concurrency();
+    return max(count, (size_t)1);
+}
+
+struct ShardControl
+{
+    pthread_barrier_t barrier;
+    size_t num_heavy;
+    double sample_seconds;
+    double exchange_seconds;
+};
+
+// Semisort arr with num_workers forked processes that exchange records through
+// one shared memory mapping, the way separate machines would over a network:
+//   1. every worker samples its num_workers-th of arr with get_sampled_elements
+//   2. worker 0 merges the samples and runs get_bucket_sizes over them; heavy
+//      keys are published and runs of the light buckets are assigned to owners
+//      so that every owner gets about as many light samples
+//   3. every worker counts its records per destination, and after a barrier
+//      writes each one straight to its final region of the shared output: light
+//      records to their owner's region, heavy records to the key's own region,
+//      which is split into num_workers even slices, one per owner, so a heavy
+//      key's records are spread over every owner whoever sent them
+//   4. every owner semisorts its region with semi_sort_rehashed; with
+//      exact_keys it also checks its slice of every heavy region for keys whose
+//      hash collided with the heavy key, and a region where any owner found one
+//      is split whole by worker h % num_workers
+// fork() copies only the calling thread, so each worker runs on a parlay
+// scheduler of its own with an even share of the threads (PARLAY_NUM_THREADS,
+// or every core). Any lock another thread of this process holds at the fork
+// stays held in the workers: call this before parlay's scheduler starts, or
+// at least outside any parallel region while its threads are idle. If a
+// worker dies or fails, the rest are killed and this throws.
+template <class Object, class Key>
+void semi_sort_sharded(
+    parlay::sequence<record<Object, Key>> &arr,
+    size_t num_workers,
+    const SemisortConfig &config = SemisortConfig(),
+    ShardedSemisortStats *stats = nullptr)
+{
+    using Record = record<Object, Key>;
+    static_assert(std::is_trivially_copyable<Record>::value, "records are exchanged as raw bytes");
+    using clock = std::chrono::steady_clock;
+    auto seconds_since = [](clock::time_point start) {
+        return std::chrono::duration<double>(clock::now() - start).count();
+    };
+
+    size_t n = arr.size();
+    size_t P = max(num_workers, (size_t)1);
+    if (n == 0)
+        return;
+
+    double logn = log2((double)max(n, (size_t)2));
+    double p = min(SAMPLE_PROBABILITY_CONSTANT / logn, 0.25);
+    size_t sample_cap = (size_t)(n / P * p) + 2;
+    // get_bucket_sizes calls a key heavy past gamma samples
+    size_t max_heavy = P * sample_cap / ((size_t)(DELTA_THRESHOLD * log((double)n)) + 1) + 1;
+    uint32_t bits = hashed_key_bits(n, config);
+    uint32_t log_num_buckets = 0;
+    while (log_num_buckets < bits && (1ull << log_num_buckets) < P * SHARD_BUCKETS_PER_WORKER)
+        log_num_buckets++;
+    size_t num_buckets = 1ull << log_num_buckets;
+    uint32_t bucket_shift = bits - log_num_buckets;
+    size_t row_size = P + max_heavy;
+
+    // size the mapping, then map it and carve the same arrays out of it
+    auto carve = [&](SharedArena &arena, ShardControl *&control, size_t *&sample_counts, Record *&samples,
+                     uint64_t *&heavy_keys, uint8_t *&heavy_mixed, size_t *&bucket_owner, size_t *&counts,
+                     double *&sort_seconds, Record *&output) {
+        control = arena.take<ShardControl>(1);
+        sample_counts = arena.take<size_t>(P);
+        samples = arena.take<Record>(P * sample_cap);
+        heavy_keys = arena.take<uint64_t>(max_heavy);
+        heavy_mixed = arena.take<uint8_t>(max_heavy);
+        bucket_owner = arena.take<size_t>(num_buckets);
+        counts = arena.take<size_t>(P * row_size);
+        sort_seconds = arena.take<double>(P);
+        output = arena.take<Record>(n);
+    };
+    ShardControl *control;
+    size_t *sample_counts, *bucket_owner, *counts;
+    Record *samples, *output;
+    uint64_t *heavy_keys;
+    uint8_t *heavy_mixed; // mmap zeroes it
+    double *sort_seconds;
+    SharedArena sizing{nullptr};
+    carve(sizing, control, sample_counts, samples, heavy_keys, heavy_mixed, bucket_owner, counts, sort_seconds, output);
+    size_t shared_bytes = sizing.used;
+    void *shared = mmap(nullptr, shared_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        throw std::runtime_error("semi_sort_sharded: cannot map shared memory");
+    SharedArena arena{static_cast<char *>(shared)};
+    carve(arena, control, sample_counts, samples, heavy_keys, heavy_mixed, bucket_owner, counts, sort_seconds, output);
+
+    pthread_barrierattr_t barrier_attr;
+    pthread_barrierattr_init(&barrier_attr);
+    pthread_barrierattr_setpshared(&barrier_attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&control->barrier, &barrier_attr, P);
+    pthread_barrierattr_destroy(&barrier_attr);
+
+    auto run_worker = [&](size_t w) {
+        auto start = clock::now();
+        size_t lo = w * n / P;
+        size_t m = (w + 1) * n / P - lo;
+        parlay::sequence<Record> shard(arr.begin() + lo, arr.begin() + lo + m);
+
+        // 1. local sample
+        size_t num_samples = (m == 0) ? 0 : min(m, max((size_t)1, (size_t)(m * p)));
+        if (num_samples > 0) {
+            parlay::sequence<uint64_t> flags(m);
+            parlay::sequence<Record> sample(num_samples);
+            std::uniform_int_distribution<size_t> dis(0, m - 1);
+            get_sampled_elements(shard, flags, sample, num_samples, m, parlay::random_generator(w), dis);
+            std::copy(sample.begin(), sample.end(), samples + w * sample_cap);
+        }
+        sample_counts[w] = num_samples;
+        pthread_barrier_wait(&control->barrier);
+
+        // 2. worker 0 lays out heavy keys and light bucket owners
+        if (w == 0) {
+            SemisortWorkspace<Object, Key, uint64_t> ws;
+            size_t total_samples = 0;
+            for (size_t i = 0; i < P; i++)
+                total_samples += sample_counts[i];
+            ensure_capacity(ws.record_scrap, total_samples);
+            for (size_t i = 0, out = 0; i < P; i++) {
+                std::copy(samples + i * sample_cap, samples + i * sample_cap + sample_counts[i], ws.record_scrap.begin() + out);
+                out += sample_counts[i];
+            }
+            parlay::internal::integer_sort_inplace(
+                make_slice(ws.record_scrap.begin(), ws.record_scrap.begin() + total_samples),
+                [](Record r) { return r.hashed_key; }, 0);
+            get_bucket_sizes(ws, total_samples, num_buckets, bucket_shift, n, DELTA_THRESHOLD, p, F_C);
+
+            control->num_heavy = ws.num_heavy_buckets;
+            for (size_t h = 0; h < ws.num_heavy_buckets; h++)
+                heavy_keys[h] = ws.heavy_key_buckets[h].bucket_id;
+            size_t total_light = 0;
+            for (size_t b = 0; b < num_buckets; b++)
+                total_light += ws.light_key_bucket_sample_counts[b];
+            for (size_t b = 0, before = 0; b < num_buckets; b++) {
+                bucket_owner[b] = total_light ? min(P - 1, before * P / total_light) : b * P / num_buckets;
+                before += ws.light_key_bucket_sample_counts[b];
+            }
+            control->sample_seconds = seconds_since(start);
+        }
+        pthread_barrier_wait(&control->barrier);
+
+        // 3. count records per destination: owners first, then heavy keys
+        start = clock::now();
+        size_t num_heavy = control->num_heavy;
+        parlay::sequence<BasicBucket<uint32_t>> heavy_buckets(num_heavy);
+        for (size_t h = 0; h < num_heavy; h++)
+            heavy_buckets[h] = {heavy_keys[h], 0, 0, true};
+        HeavyKeyTable<uint32_t> heavy_table;
+        heavy_table.build(heavy_buckets, num_heavy);
+        auto destinations = parlay::map(shard, [&](const Record &r) -> size_t {
+            uint32_t heavy;
+            if (heavy_table.find_index(r.hashed_key, heavy))
+                return P + heavy;
+            return bucket_owner[light_bucket_index(r.hashed_key, bucket_shift, num_buckets)];
+        });
+        size_t *row = counts + w * row_size;
+        std::fill(row, row + P + num_heavy, 0);
+        for (size_t d : destinations)
+            row[d]++;
+        pthread_barrier_wait(&control->barrier);
+
+        // 4. destinations are laid out in order, and within one the senders in
+        // rank order, so every sender knows where its records go
+        size_t num_destinations = P + num_heavy;
+        parlay::sequence<size_t> region_starts(num_destinations + 1), cursor(num_destinations);
+        region_starts[0] = 0;
+        for (size_t d = 0; d < num_destinations; d++) {
+            size_t offset = region_starts[d];
+            for (size_t i = 0; i < P; i++) {
+                if (i == w)
+                    cursor[d] = offset;
+                offset += counts[i * row_size + d];
+            }
+            region_starts[d + 1] = offset;
+        }
+        for (size_t j = 0; j < m; j++)
+            output[cursor[destinations[j]]++] = shard[j];
+        pthread_barrier_wait(&control->barrier);
+        if (w == 0)
+            control->exchange_seconds = seconds_since(start);
+
+        // 5. semisort the owned light region; heavy regions are grouped already,
+        // but with exact keys every owner flags the regions whose slice it owns
+        // mixes keys, and worker h % P splits flagged region h
+        start = clock::now();
+        if (config.exact_keys) {
+            for (size_t h = 0; h < num_heavy; h++) {
+                size_t region_start = region_starts[P + h];
+                size_t region_size = region_starts[P + h + 1] - region_start;
+                if (region_size == 0)
+                    continue;
+                const Record &first = output[region_start];
+                for (size_t j = region_start + w * region_size / P; j < region_start + (w + 1) * region_size / P; j++) {
+                    if (!(output[j].key == first.key)) {
+                        reinterpret_cast<std::atomic<uint8_t> *>(&heavy_mixed[h])->store(1, std::memory_order_relaxed);
+                        break;
+                    }
+                }
+            }
+            pthread_barrier_wait(&control->barrier);
+        }
+        auto sort_region = [&](size_t d, auto sort) {
+            parlay::sequence<Record> region(output + region_starts[d], output + region_starts[d + 1]);
+            sort(region);
+            std::copy(region.begin(), region.end(), output + region_starts[d]);
+        };
+        sort_region(w, [&](parlay::sequence<Record> &region) {
+            if (index_width_fits<uint32_t>(region.size())) {
+                SemisortIndexWorkspace<Object, Key, uint32_t> ws;
+                semi_sort_rehashed(region, ws, config);
+            } else {
+                SemisortIndexWorkspace<Object, Key, uint64_t> ws;
+                semi_sort_rehashed(region, ws, config);
+            }
+        });
+        if (config.exact_keys) {
+            for (size_t h = w; h < num_heavy; h += P)
+                if (heavy_mixed[h])
+                    sort_region(P + h, [](parlay::sequence<Record> &region) { split_collided_records(region); });
+        }
+        sort_seconds[w] = seconds_since(start);
+    };
+
+    // the others wait at a barrier for a worker that died, so the first
+    // failure, or a fork that never happened, kills every worker still running
+    parlay::sequence<pid_t> workers(P, 0);
+    unsigned int worker_threads = max(shard_total_threads() / P, (size_t)1);
+    bool failed = false;
+    for (size_t w = 0; w < P && !failed; w++) {
+        workers[w] = fork();
+        if (workers[w] == 0) {
+            int status = 0;
+            try {
+                parlay::execute_with_scheduler(worker_threads, [&] { run_worker(w); });
+            } catch (...) {
+                status = 1;
+            }
+            _exit(status);
+        }
+        failed = workers[w] < 0;
+    }
+    bool fork_failed = failed;
+    size_t running = 0;
+    for (pid_t &pid : workers) {
+        if (pid < 0)
+            pid = 0;
+        running += pid != 0;
+    }
+    auto kill_workers = [&] {
+        for (pid_t pid : workers)
+            if (pid != 0)
+                kill(pid, SIGKILL);
+    };
+    if (failed)
+        kill_workers();
+    while (running > 0) {
+        bool reaped = false;
+        for (pid_t &pid : workers) {
+            int status;
+            if (pid == 0 || waitpid(pid, &status, WNOHANG) != pid)
+                continue;
+            pid = 0;
+            running--;
+            reaped = true;
+            if (!failed && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+                failed = true;
+                kill_workers();
+            }
+        }
+        if (!reaped)
+            usleep(SHARD_POLL_MICROSECONDS);
+    }
+
+    if (!failed) {
+        parallel_for(0, n, [&](size_t i) {
+            arr[i] = output[i];
+        });
+        if (stats != nullptr) {
+            stats->num_workers = P;
+            stats->num_heavy_keys = control->num_heavy;
+            stats->largest_shard = 0;
+            stats->sort_seconds = 0;
+            for (size_t w = 0; w < P; w++) {
+                size_t region_size = 0;
+                for (size_t i = 0; i < P; i++)
+                    region_size += counts[i * row_size + w];
+                stats->largest_shard = max(stats->largest_shard, region_size);
+                stats->sort_seconds = max(stats->sort_seconds, sort_seconds[w]);
+            }
+            stats->sample_seconds = control->sample_seconds;
+            stats->exchange_seconds = control->exchange_seconds;
+        }
+    }
+    pthread_barrier_destroy(&control->barrier);
+    munmap(shared, shared_bytes);
+    if (fork_failed)
+        throw std::runtime_error("semi_sort_sharded: fork failed");
+    if (failed)
+        throw std::runtime_error("semi_sort_sharded: a worker failed");
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <string>
+
+// Per phase wall time and counters of semisort calls, filled in through
+// SemisortConfig::stats when the library is built with SEMISORT_STATS.
+// Without it every hook below is an empty inline function and the struct is
+// never written. Calls add to what is there, so zero it between runs.
+struct SemisortStats
+{
+    // wall seconds per phase
+    double hash_seconds = 0;          // semi_sort_with_hash, semisort_indices
+    double sample_seconds = 0;        // picking and packing the sample
+    double sort_samples_seconds = 0;
+    double bucket_sizes_seconds = 0;  // get_bucket_sizes or its sketch pass, heavy table, bucket array
+    double scatter_seconds = 0;       // every scatter pass
+    double heavy_scatter_seconds = 0; // unfused RandomCas only: its heavy pass
+    double light_scatter_seconds = 0; // unfused RandomCas only: its light pass
+    double light_sort_seconds = 0;
+    double pack_seconds = 0;
+    double split_seconds = 0;         // exact_keys collision splitting
+
+    // counters, summed over calls
+    size_t calls = 0;
+    size_t records = 0;
+    size_t num_heavy_keys = 0;
+    size_t num_light_buckets = 0;
+    size_t bucket_slots = 0;
+    // CAS scatters: slots probed, CAS lost to another worker, probes that ran
+    // off the end of a bucket and restarted at a random slot, longest probe
+    size_t probes = 0;
+    size_t cas_failures = 0;
+    size_t wraparounds = 0;
+    size_t max_probe_length = 0;
+
+    // records per bucket array slot
+    double fill_ratio() const
+    {
+        return bucket_slots ? (double)records / bucket_slots : 0;
+    }
+
+    // mean slots probed per record placed by a CAS scatter
+    double mean_probe_length() const
+    {
+        return records ? (double)probes / records : 0;
+    }
+
+    std::string to_json() const
+    {
+        char buffer[1024];
+        snprintf(buffer, sizeof(buffer),
+                 "{\"hash_seconds\": %.9g, \"sample_seconds\": %.9g, \"sort_samples_seconds\": %.9g, "
+                 "\"bucket_sizes_seconds\": %.9g, \"scatter_seconds\": %.9g, \"heavy_scatter_seconds\": %.9g, "
+                 "\"light_scatter_seconds\": %.9g, \"light_sort_seconds\": %.9g, \"pack_seconds\": %.9g, "
+                 "\"split_seconds\": %.9g, \"calls\": %zu, \"records\": %zu, \"num_heavy_keys\": %zu, "
+                 "\"num_light_buckets\": %zu, \"bucket_slots\": %zu, \"fill_ratio\": %.9g, \"probes\": %zu, "
+                 "\"mean_probe_length\": %.9g, \"cas_failures\": %zu, \"wraparounds\": %zu, \"max_probe_length\": %zu}",
+                 hash_seconds, sample_seconds, sort_samples_seconds, bucket_sizes_seconds, scatter_seconds,
+                 heavy_scatter_seconds, light_scatter_seconds, light_sort_seconds, pack_seconds, split_seconds, calls,
+                 records, num_heavy_keys, num_light_buckets, bucket_slots, fill_ratio(), probes, mean_probe_length(),
+                 cas_failures, wraparounds, max_probe_length);
+        return buffer;
+    }
+};
+
+// Times consecutive phases: lap(stats, field) adds the time since the previous
+// lap (or construction) to stats->*field
+struct StatsClock
+{
+#ifdef SEMISORT_STATS
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+    void lap(SemisortStats *stats, double SemisortStats::*field)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (stats != nullptr)
+            stats->*field += std::chrono::duration<double>(now - last).count();
+        last = now;
+    }
+#else
+    void lap(SemisortStats *, double SemisortStats::*) {}
+#endif
+};
+
+// Probe counters of one scatter task, added to the stats when it finishes
+struct ScatterCounters
+{
+#ifdef SEMISORT_STATS
+    size_t probes = 0;
+    size_t cas_failures = 0;
+    size_t wraparounds = 0;
+    size_t max_probe_length = 0;
+
+    void probe() { probes++; }
+    void cas_failure() { cas_failures++; }
+    void wraparound() { wraparounds++; }
+    void placed(size_t probe_length) { max_probe_length = std::max(max_probe_length, probe_length); }
+
+    void add_to(SemisortStats *stats) const
+    {
+        if (stats == nullptr)
+            return;
+        auto add = [](size_t &total, size_t value) {
+            reinterpret_cast<std::atomic<size_t> *>(&total)->fetch_add(value, std::memory_order_relaxed);
+        };
+        add(stats->probes, probes);
+        add(stats->cas_failures, cas_failures);
+        add(stats->wraparounds, wraparounds);
+        auto &longest = *reinterpret_cast<std::atomic<size_t> *>(&stats->max_probe_length);
+        size_t seen = longest.load(std::memory_order_relaxed);
+        while (seen < max_probe_length && !longest.compare_exchange_weak(seen, max_probe_length))
+            ;
+    }
+#else
+    void probe() {}
+    void cas_failure() {}
+    void wraparound() {}
+    void placed(size_t) {}
+    void add_to(SemisortStats *) const {}
+#endif
+};
+
+// add the bucket layout of one call to the stats
+inline void count_layout(SemisortStats *stats, size_t n, size_t num_heavy, size_t num_light, size_t bucket_slots)
+{
+#ifdef SEMISORT_STATS
+    if (stats == nullptr)
+        return;
+    stats->calls++;
+    stats->records += n;
+    stats->num_heavy_keys += num_heavy;
+    stats->num_light_buckets += num_light;
+    stats->bucket_slots += bucket_slots;
+#else
+    (void)stats, (void)n, (void)num_heavy, (void)num_light, (void)bucket_slots;
+#endif
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <string_view>
+
+#include "semisort_group_by.h"
+
+// Variable length keys stored back to back in one buffer: key i is
+// data[offsets[i], offsets[i + 1]). Both are borrowed, so keys are read as
+// string_views into the caller's memory (a log file, an mmap) and never copied.
+struct StringKeyArena
+{
+    std::string_view data;
+    const uint64_t *offsets; // num_keys + 1 entries
+    size_t num_keys;
+
+    size_t size() const { return num_keys; }
+
+    std::string_view operator[](size_t i) const
+    {
+        return data.substr(offsets[i], offsets[i + 1] - offsets[i]);
+    }
+};
+
+// Semisort string keys without building records or interning them: the keys are
+// hashed straight out of the arena and semisorted through semisort_indices, then
+// groups whose hashes collided are split by comparing the strings themselves
+// (config.exact_keys is always on), so every returned group holds one key.
+template <class Index = uint32_t, class Hash = std::hash<std::string_view>>
+SemisortIndices<Index> semisort_string_keys(
+    const StringKeyArena &keys,
+    SemisortIndexWorkspace<Index, Index, Index> &ws,
+    const SemisortConfig &config = SemisortConfig(),
+    Hash hash_fn = Hash())
+{
+    SemisortConfig exact_config = config;
+    exact_config.exact_keys = true;
+    return semisort_indices<Index>(keys, ws, exact_config, hash_fn);
+}
+
+template <class Index = uint32_t>
+SemisortIndices<Index> semisort_string_keys(const StringKeyArena &keys, const SemisortConfig &config = SemisortConfig())
+{
+    SemisortIndexWorkspace<Index, Index, Index> ws;
+    return semisort_string_keys<Index>(keys, ws, config);
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "parlay/sequence.h"
+
+// The sampling and bucketing constants build_buckets runs with, fixed to
+// namespace constants unless SemisortConfig::profile tunes them
+struct SemisortTuning
+{
+    float sample_probability_constant;
+    float delta_threshold;
+    float f_c;
+    float light_key_bucket_constant;
+};
+
+// What the sorted sample of an input looks like, see classify_sample
+enum class SampleShape
+{
+    // not sampled yet; also the fallback line of a profile
+    Any,
+    // nearly every sampled key is unique
+    Distinct,
+    // keys repeat, but none often enough to be heavy
+    Duplicated,
+    // part of the sample falls on heavy keys
+    Skewed,
+    // most of the sample falls on heavy keys
+    HeavyDominated
+};
+
+const char *const SAMPLE_SHAPE_NAMES[] = {"any", "distinct", "duplicated", "skewed", "heavy"};
+const size_t NUM_SAMPLE_SHAPES = 5;
+
+// Tuned constants per worker count and sample shape, as written by
+// benchmark/tune_semisort, one entry per line:
+//   <workers> <shape> <sample constant> <delta threshold> <f_c> <light bucket constant>
+// where '#' starts a comment. The sample is drawn before its shape is known,
+// so a call always samples with the sample constant of the Any line.
+struct SemisortProfile
+{
+    struct Entry
+    {
+        size_t workers;
+        SampleShape shape;
+        SemisortTuning tuning;
+    };
+
+    parlay::sequence<Entry> entries;
+
+    // Set tuning to the entry for shape at the largest worker count up to
+    // workers (the smallest count if all are larger), or to that count's Any
+    // line if shape has none. False if there is neither.
+    bool find(size_t workers, SampleShape shape, SemisortTuning &tuning) const
+    {
+        bool found_count = false;
+        size_t count = 0;
+        for (const Entry &entry : entries) {
+            if (entry.workers <= workers && (!found_count || entry.workers > count)) {
+                count = entry.workers;
+                found_count = true;
+            }
+        }
+        for (const Entry &entry : entries) {
+            if (!found_count || (count > workers && entry.workers < count)) {
+                count = entry.workers;
+                found_count = true;
+            }
+        }
+        if (!found_count)
+            return false;
+
+        const Entry *any = nullptr;
+        for (const Entry &entry : entries) {
+            if (entry.workers != count)
+                continue;
+            if (entry.shape == shape) {
+                tuning = entry.tuning;
+                return true;
+            }
+            if (entry.shape == SampleShape::Any)
+                any = &entry;
+        }
+        if (any == nullptr)
+            return false;
+        tuning = any->tuning;
+        return true;
+    }
+
+    void write(FILE *out) const
+    {
+        fprintf(out, "# workers shape sample_constant delta_threshold f_c light_key_bucket_constant\n");
+        for (const Entry &entry : entries)
+            fprintf(out, "%zu %s %g %g %g %g\n", entry.workers, SAMPLE_SHAPE_NAMES[(int)entry.shape],
+                    entry.tuning.sample_probability_constant, entry.tuning.delta_threshold, entry.tuning.f_c,
+                    entry.tuning.light_key_bucket_constant);
+    }
+
+    static SemisortProfile read(const std::string &path)
+    {
+        FILE *in = fopen(path.c_str(), "r");
+        if (in == nullptr)
+            throw std::runtime_error("cannot open " + path);
+        SemisortProfile profile;
+        char line[256];
+        for (size_t line_number = 1; fgets(line, sizeof(line), in) != nullptr; line_number++) {
+            char *comment = strchr(line, '#');
+            if (comment != nullptr)
+                *comment = '\0';
+            Entry entry;
+            char shape[32];
+            char extra;
+            int fields = sscanf(line, "%zu %31s %f %f %f %f %c", &entry.workers, shape,
+                                &entry.tuning.sample_probability_constant, &entry.tuning.delta_threshold,
+                                &entry.tuning.f_c, &entry.tuning.light_key_bucket_constant, &extra);
+            if (fields <= 0)
+                continue;
+            size_t s = 0;
+            while (s < NUM_SAMPLE_SHAPES && strcmp(shape, SAMPLE_SHAPE_NAMES[s]) != 0)
+                s++;
+            if (fields != 6 || s == NUM_SAMPLE_SHAPES) {
+                fclose(in);
+                throw std::runtime_error(path + ":" + std::to_string(line_number) + ": bad profile line");
+            }
+            entry.shape = (SampleShape)s;
+            profile.entries.push_back(entry);
+        }
+        fclose(in);
+        return profile;
+    }
+};
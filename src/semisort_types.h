@@ -1,10 +1,17 @@
+#pragma once
 #include "parlay/utilities.h"
 #include "parlay/primitives.h"
 #include "parlay/parallel.h"
 #include "parlay/sequence.h"
-#include "parlay/hash_table.h"
 #include "parlay/random.h"
 
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include "semisort_stats.h"
+#include "semisort_tuning.h"
+
 template <class A, class B>
 struct record
 {
@@ -28,42 +35,455 @@ struct record
     }
 };
 
-struct Bucket
+// offset and size are Index wide; 64 bits lets the bucket array pass 4B slots
+template <class Index>
+struct BasicBucket
 {
     unsigned long long bucket_id;
-    unsigned int offset;
-    unsigned int size : 31;
+    Index offset;
+    Index size : 8 * sizeof(Index) - 1;
     bool isHeavy;
 
-    inline bool operator!=(Bucket a)
+    inline bool operator!=(BasicBucket a)
     {
         return a.bucket_id != bucket_id || a.offset != offset || a.size != size || a.isHeavy != isHeavy;
     }
 
-    inline bool operator==(Bucket a)
+    inline bool operator==(BasicBucket a)
     {
         return a.bucket_id == bucket_id && a.size == size && a.offset == offset && a.isHeavy == isHeavy;
     }
 };
 
-struct hash_buckets
-{
-    using eType = Bucket;
-    using kType = unsigned long long;
-    eType empty() { return {0, 0, 0, 0}; }
-    kType getKey(eType v) { return v.bucket_id; }
-    size_t hash(kType v) { return static_cast<size_t>(parlay::hash64(v)); }
-    int cmp(kType v, kType b) { return (v > b) ? 1 : ((v == b) ? 0 : -1); }
-    bool replaceQ(eType, eType) { return 0; }
-    eType update(eType v, eType) { return v; }
-    bool cas(eType *p, eType o, eType n)
-    {
-        auto pb = reinterpret_cast<std::atomic<unsigned long long> *>(&(p->bucket_id));
-        if (std::atomic_compare_exchange_strong_explicit(pb, &(o.bucket_id), n.bucket_id, std::memory_order_relaxed, std::memory_order_relaxed))
-        {
-            *p = n;
-            return true;
+using Bucket = BasicBucket<uint32_t>;
+
+// grow seq to hold at least size elements, doubling so repeated calls settle
+template <class T>
+inline void ensure_capacity(parlay::sequence<T> &seq, size_t size)
+{
+    if (seq.size() < size)
+        seq = parlay::sequence<T>(std::max(size, 2 * seq.size()));
+}
+
+// make seq exactly size elements long, keeping its buffer unless it has to grow
+// (by doubling, as ensure_capacity); the caller overwrites every element
+template <class T>
+inline void ensure_size(parlay::sequence<T> &seq, size_t size)
+{
+    if (seq.capacity() < size) {
+        parlay::sequence<T> grown;
+        grown.reserve(std::max(size, 2 * seq.capacity()));
+        seq = std::move(grown);
+    }
+    seq.resize(size);
+}
+
+template <class eType>
+inline bool bucket_cas(eType *p, eType o, eType n)
+{
+    return std::atomic_compare_exchange_strong_explicit(
+        reinterpret_cast<std::atomic<eType> *>(p), &o, n, std::memory_order_relaxed, std::memory_order_relaxed);
+}
+
+// Open-addressed table from heavy hashed key to its bucket. There are at most
+// num_samples / gamma heavy keys, so the table is small, and a one-hash bit
+// filter in front of it answers most light-key queries without touching it.
+template <class Index = uint32_t>
+struct HeavyKeyTable
+{
+    using Bucket = BasicBucket<Index>;
+
+    parlay::sequence<Bucket> slots;     // bucket_id 0 marks an empty slot
+    parlay::sequence<uint32_t> indices; // position of each slot's bucket in heavy_key_buckets
+    parlay::sequence<uint64_t> filter;
+    size_t table_size = 0;              // power of two, prefix of slots in use
+    size_t filter_size = 0;             // words, power of two, prefix of filter in use
+
+    static inline uint64_t slot_hash(uint64_t hashed_key) { return hashed_key * 0x9E3779B97F4A7C15ull; }
+    static inline uint64_t filter_hash(uint64_t hashed_key) { return hashed_key * 0xC2B2AE3D27D4EB4Full; }
+
+    // size the table for num_heavy keys and insert them in parallel
+    void build(parlay::sequence<Bucket> &heavy_key_buckets, size_t num_heavy)
+    {
+        table_size = 16;
+        while (table_size < 2 * num_heavy)
+            table_size *= 2;
+        filter_size = table_size / 8;  // at least 16 filter bits per heavy key
+        ensure_capacity(slots, table_size);
+        ensure_capacity(indices, table_size);
+        ensure_capacity(filter, filter_size);
+
+        uint64_t table_mask = table_size - 1;
+        parlay::parallel_for(0, num_heavy, [&](size_t i) {
+            Bucket bucket = heavy_key_buckets[i];
+            size_t h = slot_hash(bucket.bucket_id) >> 32 & table_mask;
+            while (!bucket_cas(&slots[h].bucket_id, 0ull, bucket.bucket_id)) {
+                if (slots[h].bucket_id == bucket.bucket_id)
+                    return;
+                h = (h + 1) & table_mask;
+            }
+            slots[h] = bucket;
+            indices[h] = i;
+
+            uint64_t bit = filter_hash(bucket.bucket_id) >> 32 & (64 * filter_size - 1);
+            reinterpret_cast<std::atomic<uint64_t> *>(&filter[bit / 64])->fetch_or(1ull << (bit % 64), std::memory_order_relaxed);
+        });
+    }
+
+    // slot holding hashed_key, or table_size if it is not heavy
+    inline size_t find_slot(uint64_t hashed_key) const
+    {
+        uint64_t bit = filter_hash(hashed_key) >> 32 & (64 * filter_size - 1);
+        if (!(filter[bit / 64] >> (bit % 64) & 1))
+            return table_size;
+        uint64_t table_mask = table_size - 1;
+        for (size_t h = slot_hash(hashed_key) >> 32 & table_mask;; h = (h + 1) & table_mask) {
+            if (slots[h].bucket_id == hashed_key)
+                return h;
+            if (slots[h].bucket_id == 0)
+                return table_size;
+        }
+    }
+
+    // true and the heavy bucket of hashed_key if it is heavy
+    inline bool find(uint64_t hashed_key, Bucket &bucket) const
+    {
+        size_t h = find_slot(hashed_key);
+        if (h == table_size)
+            return false;
+        bucket = slots[h];
+        return true;
+    }
+
+    // true and the position of hashed_key's bucket in heavy_key_buckets if it is heavy
+    inline bool find_index(uint64_t hashed_key, uint32_t &index) const
+    {
+        size_t h = find_slot(hashed_key);
+        if (h == table_size)
+            return false;
+        index = indices[h];
+        return true;
+    }
+
+    void clear()
+    {
+        parlay::parallel_for(0, table_size, [&](size_t i) {
+            slots[i].bucket_id = 0;
+        });
+        parlay::parallel_for(0, filter_size, [&](size_t i) {
+            filter[i] = 0;
+        });
+    }
+
+    size_t bytes() const
+    {
+        return slots.size() * sizeof(Bucket) + indices.size() * sizeof(uint32_t) + filter.size() * sizeof(uint64_t);
+    }
+};
+
+// Misra-Gries summary of a stream of hashed keys in at most capacity counters.
+// A new key that finds every counter taken takes one off each of them and off
+// itself, so a count falls short of its key's frequency by at most decrements,
+// which stays under the stream length / (capacity + 1).
+struct HeavyHitterSketch
+{
+    parlay::sequence<uint64_t> keys;   // 0 marks an empty slot
+    parlay::sequence<uint64_t> counts;
+    parlay::sequence<uint64_t> kept;   // (key, count) pairs surviving a decrement
+    size_t capacity = 0;
+    size_t table_mask = 0;
+    size_t size = 0;
+    size_t decrements = 0;
+
+    void reset(size_t counters)
+    {
+        size_t table_size = 16;
+        while (table_size < 2 * counters)
+            table_size *= 2;
+        ensure_capacity(keys, table_size);
+        ensure_capacity(counts, table_size);
+        ensure_capacity(kept, 2 * counters);
+        std::fill(keys.begin(), keys.begin() + table_size, 0);
+        capacity = counters;
+        table_mask = table_size - 1;
+        size = 0;
+        decrements = 0;
+    }
+
+    inline void add(uint64_t hashed_key)
+    {
+        size_t h = HeavyKeyTable<>::slot_hash(hashed_key) >> 32 & table_mask;
+        for (; keys[h] != 0; h = (h + 1) & table_mask) {
+            if (keys[h] == hashed_key) {
+                counts[h]++;
+                return;
+            }
+        }
+        if (size < capacity) {
+            keys[h] = hashed_key;
+            counts[h] = 1;
+            size++;
+            return;
+        }
+
+        // decrement every counter and rebuild the table from those left
+        decrements++;
+        size_t num_kept = 0;
+        for (size_t i = 0; i <= table_mask; i++) {
+            if (keys[i] != 0 && counts[i] > 1) {
+                kept[2 * num_kept] = keys[i];
+                kept[2 * num_kept + 1] = counts[i] - 1;
+                num_kept++;
+            }
+            keys[i] = 0;
+        }
+        for (size_t j = 0; j < num_kept; j++) {
+            h = HeavyKeyTable<>::slot_hash(kept[2 * j]) >> 32 & table_mask;
+            while (keys[h] != 0)
+                h = (h + 1) & table_mask;
+            keys[h] = kept[2 * j];
+            counts[h] = kept[2 * j + 1];
         }
-        return false;
+        size = num_kept;
+    }
+
+    size_t bytes() const
+    {
+        return (keys.size() + counts.size() + kept.size()) * sizeof(uint64_t);
+    }
+};
+
+// A record the StagedCas scatter has yet to insert, copied out of the input
+// with the slot its probe starts at and the range of its bucket
+template <class Object, class Key, class Index>
+struct StagedRecord
+{
+    record<Object, Key> rec;
+    Index first_slot;
+    Index bucket_offset;
+    Index bucket_size;
+};
+
+// KeyOf of records that already carry their hashed keys. Any other KeyOf maps a
+// record to its integer key, and build_buckets hashes the records itself.
+struct KeysHashed
+{
+};
+
+// Which records a scatter_keys pass moves into the bucket array
+enum class ScatterKeys
+{
+    Heavy,
+    Light,
+    All
+};
+
+// How records are moved into the bucket array
+enum class ScatterEngine
+{
+    // random slot in an oversized bucket, linear probing with CAS on hashed_key
+    RandomCas,
+    // blocked histograms over bucket ids, a scan, then contention-free writes
+    // into exactly sized buckets
+    CountingPlace,
+    // RandomCas over large blocks of the input, prefetching the first probe of
+    // the records a few positions ahead
+    PrefetchCas,
+    // RandomCas with the records staged per region of the bucket array and
+    // inserted a few cache lines of them at a time
+    StagedCas
+};
+
+// Where the pages of the bucket array live on a multi-socket machine
+enum class NumaPlacement
+{
+    // wherever the workers that first zero them run
+    Naive,
+    // round robin over all nodes
+    Interleave,
+    // node k holds the k-th slice of the array, so the buckets laid out there;
+    // the CAS engines all scatter through scatter_keys_numa, whose
+    // workers insert the records of their own node's buckets first
+    Local
+};
+
+// How build_buckets finds the heavy keys and sizes the buckets
+enum class HeavyDetection
+{
+    // sort a sample and call keys seen more than DELTA_THRESHOLD * log n times
+    // in it heavy; light buckets are sized from the sample
+    Sample,
+    // one pass over every record into per block Misra-Gries sketches and light
+    // bucket histograms, merged; keys whose merged count passes the threshold
+    // the sample implies, less the sketch error, are heavy, and every bucket is
+    // sized from a bound on its records instead of a sample estimate
+    Sketch
+};
+
+// Runtime switches for comparing semisort variants
+struct SemisortConfig
+{
+    ScatterEngine scatter_engine = ScatterEngine::RandomCas;
+    // RandomCas only: scatter heavy and light records in one pass over the
+    // input instead of two
+    bool fused_scatter = true;
+    // semi_sort only: semisort compact (index, hashed_key) records and gather
+    // the payloads once at the end, see semi_sort_by_index
+    bool sort_by_index = false;
+    // compare the real keys after grouping by hashed key and split groups whose
+    // hashes collided, so every group holds one key (see split_collided_groups)
+    bool exact_keys = false;
+    // width of the hashed keys semi_sort_with_hash and semisort_indices draw,
+    // 0 for hash_range_bits(n); a smaller range only stays correct with
+    // exact_keys, and light buckets are laid out over the same range
+    uint32_t hash_bits = 0;
+    // odd multiplier of the multiply-shift hash those calls and
+    // semi_sort_external draw hashed keys with; 0 draws a fresh one per call,
+    // so keys that collide in one call are unlikely to collide again. Set it to
+    // reproduce a run
+    uint64_t hash_multiplier = 0;
+    // sort inputs under SMALL_SORT_MAX records directly, and scatter inputs
+    // whose sample holds at most FEW_KEYS_MAX distinct keys into one exactly
+    // sized bucket per key; off forces the sampling path, for benchmarks
+    bool fast_paths = true;
+    // keep the records of every group in input order: buckets are filled by
+    // the counting scatter whatever scatter_engine says, and light buckets and
+    // small inputs are sorted stably
+    bool stable = false;
+    // Sketch draws no sample, so it never takes the few keys path and a profile
+    // only contributes its Any line; semi_sort_sharded and the external
+    // semisort always sample
+    HeavyDetection heavy_detection = HeavyDetection::Sample;
+    // needs libnuma (SEMISORT_NUMA) and trivially copyable records, otherwise
+    // every placement is Naive
+    NumaPlacement numa_placement = NumaPlacement::Naive;
+    // pick the sampling and bucketing constants from this profile by worker
+    // count and sample shape instead of namespace constants, see semisort_tuning
+    const SemisortProfile *profile = nullptr;
+    // per phase times and counters are added here when built with
+    // SEMISORT_STATS; every call that takes this config reports
+    SemisortStats *stats = nullptr;
+};
+
+// Scratch memory used by one semisort call, filled in when requested
+struct SemisortFootprint
+{
+    size_t n;
+    size_t num_samples;
+    size_t bucket_slots;
+    size_t heavy_table_slots;
+    size_t peak_bytes;
+};
+
+// Scratch space for semi_sort_without_alloc that outlives a single call. Every
+// buffer only grows, so once the workspace has seen its largest batch further
+// calls reuse it; reset() undoes only what the previous call wrote.
+// Index is the width of bucket offsets and sizes and of the counters below; it
+// must hold BUCKET_SPACE_FACTOR * n slots (see index_width_fits).
+template <class Object, class Key, class Index = uint32_t>
+struct SemisortWorkspace
+{
+    using Bucket = BasicBucket<Index>;
+
+    parlay::sequence<uint64_t> int_scrap;
+    parlay::sequence<record<Object, Key>> record_scrap;
+    parlay::sequence<record<Object, Key>> buckets;
+    parlay::sequence<Bucket> heavy_key_buckets;
+    parlay::sequence<Bucket> light_buckets;
+
+    // get_bucket_sizes temporaries
+    parlay::sequence<uint64_t> differences;
+    parlay::sequence<uint64_t> offsets;
+    parlay::sequence<uint64_t> counts;
+    parlay::sequence<uint64_t> unique_hashed_keys;
+    parlay::sequence<Index> light_key_bucket_sample_counts;
+    parlay::sequence<uint64_t> light_sample_prefix;
+    parlay::sequence<Index> layout_offsets;
+
+    HeavyKeyTable<Index> heavy_table;
+
+    // HeavyDetection::Sketch: one sketch per block of the input
+    parlay::sequence<HeavyHitterSketch> sketches;
+
+    // records per light bucket after sorting, and pack segment offsets
+    parlay::sequence<Index> light_counts;
+    parlay::sequence<Index> segment_offsets;
+
+    // bucket of every record, written by the CountingPlace scatter or by the
+    // hash pass of build_buckets, and the per block counts
+    parlay::sequence<Index> bucket_ids;
+    parlay::sequence<Index> block_counts;
+
+    // how the pages of buckets were placed, and for NumaPlacement::Local the
+    // records per node slice and the layout size the slices were cut for
+    NumaPlacement bucket_placement = NumaPlacement::Naive;
+    size_t bucket_node_span = 0;
+    size_t bucket_node_size = 0;
+
+    // scatter_keys_numa: node of every record's bucket, and the input
+    // positions grouped by node
+    parlay::sequence<uint8_t> record_nodes;
+    parlay::sequence<Index> node_order;
+
+    // scatter_keys_staged: a staging block per worker and region, and the
+    // records in each
+    parlay::sequence<StagedRecord<Object, Key, Index>> staging;
+    parlay::sequence<uint32_t> staging_counts;
+
+    // extent of the previous call; counted is set if scatter_keys_counting
+    // filled the buckets, back to back with no empty slots
+    bool counted = false;
+    size_t num_heavy_buckets = 0;
+    size_t num_light_buckets = 0;
+    size_t buckets_size = 0;
+
+    // clear the bucket slots and table entries of the previous call
+    void reset()
+    {
+        parlay::parallel_for(0, buckets_size, [&](size_t i) {
+            buckets[i].hashed_key = 0;
+        });
+        heavy_table.clear();
+        num_heavy_buckets = 0;
+        num_light_buckets = 0;
+        buckets_size = 0;
+    }
+
+    size_t bytes() const
+    {
+        size_t sketch_bytes = 0;
+        for (const HeavyHitterSketch &sketch : sketches)
+            sketch_bytes += sketch.bytes();
+        return int_scrap.size() * sizeof(uint64_t) + record_nodes.size() * sizeof(uint8_t) +
+               staging.size() * sizeof(StagedRecord<Object, Key, Index>) + staging_counts.size() * sizeof(uint32_t) +
+               (record_scrap.size() + buckets.size()) * sizeof(record<Object, Key>) +
+               (heavy_key_buckets.size() + light_buckets.size()) * sizeof(Bucket) + heavy_table.bytes() +
+               sketch_bytes +
+               (differences.size() + offsets.size() + counts.size() + unique_hashed_keys.size() +
+                light_sample_prefix.size()) * sizeof(uint64_t) +
+               (light_key_bucket_sample_counts.size() + layout_offsets.size() + light_counts.size() + segment_offsets.size() +
+                bucket_ids.size() + block_counts.size() + node_order.size()) * sizeof(Index);
     }
-};
\ No newline at end of file
+};
+
+// The compact record semi_sort_by_index sorts: obj is the position in the input
+template <class Index = uint32_t>
+using index_record = record<Index, Index>;
+
+// Result of semisort_indices
+template <class Index = uint32_t>
+struct SemisortIndices
+{
+    parlay::sequence<Index> permutation;   // input position of each output element
+    parlay::sequence<Index> group_offsets; // start of each group in permutation
+};
+
+// Scratch space for semi_sort_by_index and semisort_indices that outlives a
+// single call
+template <class Object, class Key, class Index = uint32_t>
+struct SemisortIndexWorkspace
+{
+    SemisortWorkspace<Index, Index, Index> index_ws;
+    parlay::sequence<index_record<Index>> index_records;
+    parlay::sequence<record<Object, Key>> gathered;
+};
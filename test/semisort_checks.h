@@ -0,0 +1,59 @@
+#pragma once
+// Inputs and checks shared by the tests: every record's obj is its input
+// position, so a semisorted output can be checked against its input
+
+#include <parlay/primitives.h>
+#include <parlay/random.h>
+
+#include <cstdio>
+#include <set>
+#include <vector>
+
+#include "../src/semisort_header.h"
+
+using Record = record<uint64_t, uint64_t>;
+
+inline int failures = 0;
+
+inline void expect(bool ok, const char *what, size_t n) {
+  if (!ok) {
+    fprintf(stderr, "FAIL %s: n=%zu\n", what, n);
+    failures++;
+  }
+}
+
+// n records over keys [0, distinct) with every fifth record on key 7, so the
+// input has a heavy key whatever distinct is, hashed with the fixed multiplier
+inline parlay::sequence<Record> test_input(size_t n, size_t distinct, uint32_t bits = 0) {
+  if (bits == 0)
+    bits = hash_range_bits(n);
+  parlay::random_generator generator;
+  std::uniform_int_distribution<uint64_t> distribution(0, distinct - 1);
+  return parlay::tabulate(n, [&](size_t i) -> Record {
+    auto r = generator[i];
+    uint64_t key = (i % 5 == 0) ? 7 : distribution(r);
+    return {i, key, multiply_shift_hash(key, bits)};
+  });
+}
+
+// out holds every record of in once, unchanged, and the records of each key
+// are contiguous
+template <class Object, class Key>
+bool is_grouped_permutation(const parlay::sequence<record<Object, Key>> &in,
+                            const parlay::sequence<record<Object, Key>> &out) {
+  if (out.size() != in.size())
+    return false;
+  std::vector<bool> seen(in.size(), false);
+  std::set<Key> finished;
+  for (size_t i = 0; i < out.size(); i++) {
+    size_t position = (size_t)out[i].obj;
+    if (position >= in.size() || seen[position] || in[position].key != out[i].key)
+      return false;
+    seen[position] = true;
+    if (i > 0 && out[i].key != out[i - 1].key)
+      finished.insert(out[i - 1].key);
+    if (finished.count(out[i].key))
+      return false;
+  }
+  return true;
+}
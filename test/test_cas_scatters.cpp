@@ -0,0 +1,47 @@
+// The CAS scatter engines, RandomCas fused and in two passes, PrefetchCas and
+// StagedCas: output is a grouped permutation of the input, for records that
+// carry their hashed keys and for records semi_sort_with_hash hashes
+
+#include <string>
+
+#include "semisort_checks.h"
+
+static void check(size_t n, size_t distinct, ScatterEngine engine, bool fused, const std::string &name) {
+  SemisortConfig config;
+  config.scatter_engine = engine;
+  config.fused_scatter = fused;
+  config.fast_paths = false;
+  auto in = test_input(n, distinct);
+
+  auto out = in;
+  semi_sort(out, config);
+  expect(is_grouped_permutation(in, out), (name + ": hashed records").c_str(), n);
+
+  out = in;
+  semi_sort_with_index_width<uint64_t>(out, config);
+  expect(is_grouped_permutation(in, out), (name + ": hashed records, 64-bit index").c_str(), n);
+
+  out = in;
+  semi_sort_with_hash(out, config);
+  expect(is_grouped_permutation(in, out), (name + ": semi_sort_with_hash").c_str(), n);
+
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+  for (int call = 0; call < 2; call++) {
+    out = in;
+    semi_sort_without_alloc(out, ws, config);
+    expect(is_grouped_permutation(in, out), (name + ": reused workspace").c_str(), n);
+  }
+}
+
+int main() {
+  for (size_t n : {size_t(1000), size_t(200000)})
+    for (size_t distinct : {size_t(10), size_t(1000), n}) {
+      check(n, distinct, ScatterEngine::RandomCas, true, "RandomCas");
+      check(n, distinct, ScatterEngine::RandomCas, false, "RandomCas unfused");
+      check(n, distinct, ScatterEngine::PrefetchCas, true, "PrefetchCas");
+      check(n, distinct, ScatterEngine::StagedCas, true, "StagedCas");
+    }
+  if (failures == 0)
+    printf("test_cas_scatters: ok\n");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+// The CountingPlace scatter: output is a grouped permutation of the input and
+// buckets come out packed, for 32- and 64-bit indices and a reused workspace
+
+#include "semisort_checks.h"
+
+static void check(size_t n, size_t distinct) {
+  SemisortConfig config;
+  config.scatter_engine = ScatterEngine::CountingPlace;
+  config.fast_paths = false;
+  auto in = test_input(n, distinct);
+
+  auto out = in;
+  semi_sort(out, config);
+  expect(is_grouped_permutation(in, out), "counting scatter", n);
+
+  out = in;
+  semi_sort_with_index_width<uint64_t>(out, config);
+  expect(is_grouped_permutation(in, out), "counting scatter, 64-bit index", n);
+
+  // a second call on the same workspace starts from what the first left
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+  for (int call = 0; call < 2; call++) {
+    out = in;
+    semi_sort_without_alloc(out, ws, config);
+    expect(is_grouped_permutation(in, out), "counting scatter, reused workspace", n);
+    expect(ws.counted && ws.buckets_size == n, "counting scatter packs n slots", n);
+  }
+}
+
+int main() {
+  for (size_t n : {size_t(1000), size_t(100000)})
+    for (size_t distinct : {size_t(10), size_t(1000), n})
+      check(n, distinct);
+  if (failures == 0)
+    printf("test_counting_scatter: ok\n");
+  return failures == 0 ? 0 : 1;
+}
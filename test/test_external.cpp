@@ -0,0 +1,78 @@
+// semi_sort_external on inputs several times its memory budget: output is a
+// grouped permutation of the input with few and many open run files, and with
+// exact keys over a hash range so narrow that heavy runs mix keys and are split
+// in several streaming rounds. The spill directory is left empty.
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "../src/semisort_external.h"
+#include "semisort_checks.h"
+
+static std::string scratch_directory() {
+  char path[] = "/tmp/test_external_XXXXXX";
+  return mkdtemp(path) ? path : "";
+}
+
+static size_t directory_entries(const std::string &path) {
+  size_t entries = 0;
+  DIR *dir = opendir(path.c_str());
+  for (dirent *entry; dir != nullptr && (entry = readdir(dir)) != nullptr;)
+    entries += std::string(entry->d_name) != "." && std::string(entry->d_name) != "..";
+  if (dir != nullptr)
+    closedir(dir);
+  return entries;
+}
+
+static void check(const std::string &directory, size_t n, size_t distinct, bool exact, uint32_t hash_bits,
+                  size_t max_open_runs) {
+  auto in = test_input(n, distinct);
+  std::string input_path = directory + "/input.bin";
+  std::string output_path = directory + "/output.bin";
+  std::string spill_directory = directory + "/spill";
+  FILE *input = fopen(input_path.c_str(), "wb");
+  fwrite(in.data(), sizeof(Record), n, input);
+  fclose(input);
+  mkdir(spill_directory.c_str(), 0700);
+
+  ExternalSemisortConfig config;
+  config.memory_budget_bytes = n * sizeof(Record) / 4;
+  config.write_block_bytes = 4096;
+  config.max_open_runs = max_open_runs;
+  config.spill_directory = spill_directory;
+  config.semisort.exact_keys = exact;
+  config.semisort.hash_bits = hash_bits;
+  auto stats = semi_sort_external<uint64_t, uint64_t>(input_path, output_path, config);
+
+  parlay::sequence<Record> out(n + 1);
+  FILE *output = fopen(output_path.c_str(), "rb");
+  out.resize(fread(out.data(), sizeof(Record), n + 1, output));
+  fclose(output);
+  expect(stats.n == n && is_grouped_permutation(in, out), exact ? "external, exact keys" : "external", n);
+  expect(directory_entries(spill_directory) == 0, "external leaves no spill files", n);
+  remove(input_path.c_str());
+  remove(output_path.c_str());
+  rmdir(spill_directory.c_str());
+}
+
+int main() {
+  std::string directory = scratch_directory();
+  if (directory.empty()) {
+    fprintf(stderr, "test_external: cannot create a scratch directory\n");
+    return 1;
+  }
+  for (size_t max_open_runs : {size_t(2), size_t(256)}) {
+    check(directory, 400000, 1000, false, 0, max_open_runs);
+    check(directory, 400000, 400000, false, 0, max_open_runs);
+    check(directory, 400000, 1000, true, 12, max_open_runs);
+    // two hashed keys: every run mixes keys
+    check(directory, 200000, 50, true, 1, max_open_runs);
+  }
+  rmdir(directory.c_str());
+  if (failures == 0)
+    printf("test_external: ok\n");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+// Groups of semisort_group_by and semisort_reduce_by_key when two keys share a
+// hashed key: one group per hashed key, or per key with exact_keys, on the
+// small input path and the bucket path alike
+
+#include <parlay/monoid.h>
+#include <parlay/primitives.h>
+
+#include <cstdio>
+#include <map>
+#include <utility>
+
+#include "../src/semisort_group_by.h"
+
+using Record = record<uint64_t, uint64_t>;
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what, size_t n, bool exact, bool fast) {
+  if (!ok) {
+    fprintf(stderr, "FAIL %s: n=%zu exact_keys=%d fast_paths=%d\n", what, n, exact, fast);
+    failures++;
+  }
+}
+
+// keys 1 and 2 (a fifth of the records each, so heavy) and keys 5 and 6 (a few
+// records, so light) are interleaved, with each pair forced onto one hashed key
+static parlay::sequence<Record> collided_input(size_t n) {
+  uint32_t bits = hash_range_bits(n);
+  return parlay::tabulate(n, [&](size_t i) -> Record {
+    uint64_t key = (i % 5 == 0) ? 1 : (i % 5 == 1) ? 2 : (i % 1000 == 2) ? 5 : (i % 1000 == 3) ? 6 : 10 + i % 997;
+    uint64_t hashed_key = multiply_shift_hash(key == 2 ? 1 : key == 6 ? 5 : key, bits);
+    return {i, key, hashed_key};
+  });
+}
+
+static void check(size_t n, bool exact, bool fast) {
+  SemisortConfig config;
+  config.exact_keys = exact;
+  config.fast_paths = fast;
+  auto in = collided_input(n);
+
+  // the groups each definition expects, with their object sums
+  std::map<uint64_t, uint64_t> expected;
+  for (const Record &r : in)
+    expected[exact ? r.key : r.hashed_key] += r.obj;
+
+  auto grouped = in;
+  auto groups = semisort_group_by(grouped, config);
+  std::map<uint64_t, uint64_t> group_sums;
+  for (auto &group : groups)
+    for (const Record &r : group.second)
+      group_sums[exact ? group.first : group.second[0].hashed_key] += r.obj;
+  expect(groups.size() == expected.size() && group_sums == expected, "group_by groups", n, exact, fast);
+
+  auto reduced = in;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+  auto totals = semisort_reduce_by_key(reduced, parlay::addm<uint64_t>(), ws, config);
+  std::map<uint64_t, uint64_t> reduce_sums;
+  uint32_t bits = hash_range_bits(n);
+  for (auto &total : totals) {
+    uint64_t key = total.first;
+    reduce_sums[exact ? key : multiply_shift_hash(key == 2 ? 1 : key == 6 ? 5 : key, bits)] += total.second;
+  }
+  expect(totals.size() == expected.size() && reduce_sums == expected, "reduce_by_key groups", n, exact, fast);
+}
+
+int main() {
+  // under SMALL_SORT_MAX the fast paths sort directly, above it buckets are built
+  for (size_t n : {size_t(5000), size_t(200000)})
+    for (bool exact : {false, true})
+      for (bool fast : {false, true})
+        check(n, exact, fast);
+  if (failures == 0)
+    printf("test_group_by: ok\n");
+  return failures == 0 ? 0 : 1;
+}
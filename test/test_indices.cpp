@@ -0,0 +1,61 @@
+// semisort_indices over a column of integer keys: the permutation holds every
+// position once and, with exact keys, every group holds all the positions of
+// one key; without, the groups are those of the hashed keys. Covers 32- and
+// 64-bit positions, a reused workspace and a delayed sequence as the column.
+
+#include <set>
+#include <vector>
+
+#include "semisort_checks.h"
+
+template <class Index, class Seq>
+static bool is_key_grouping(const Seq &keys, const SemisortIndices<Index> &result) {
+  size_t n = keys.size();
+  if (result.permutation.size() != n)
+    return false;
+  std::vector<bool> seen(n, false);
+  std::set<uint64_t> grouped;
+  size_t num_groups = result.group_offsets.size();
+  for (size_t g = 0; g < num_groups; g++) {
+    size_t start = result.group_offsets[g];
+    size_t end = (g + 1 < num_groups) ? result.group_offsets[g + 1] : n;
+    if (start >= end || !grouped.insert(keys[result.permutation[start]]).second)
+      return false;
+    for (size_t j = start; j < end; j++) {
+      size_t position = result.permutation[j];
+      if (position >= n || seen[position] || keys[position] != keys[result.permutation[start]])
+        return false;
+      seen[position] = true;
+    }
+  }
+  return true;
+}
+
+static void check(size_t n, size_t distinct) {
+  auto column = parlay::map(test_input(n, distinct), [](const Record &r) { return r.key; });
+  SemisortConfig config;
+  config.exact_keys = true;
+
+  expect(is_key_grouping(column, semisort_indices(column, config)), "indices", n);
+  expect(is_key_grouping(column, semisort_indices<uint64_t>(column, config)), "indices, 64-bit positions", n);
+  SemisortIndexWorkspace<uint32_t, uint32_t, uint32_t> ws;
+  for (int call = 0; call < 2; call++)
+    expect(is_key_grouping(column, semisort_indices(column, ws, config)), "indices, reused workspace", n);
+  auto delayed = parlay::delayed_seq<uint64_t>(n, [&](size_t i) { return column[i]; });
+  expect(is_key_grouping(column, semisort_indices(delayed, config)), "indices of a delayed sequence", n);
+
+  // without exact keys groups follow hashed keys, which a narrow range merges
+  config.exact_keys = false;
+  config.hash_bits = 4;
+  auto merged = semisort_indices(column, config);
+  expect(merged.permutation.size() == n && merged.group_offsets.size() <= 16, "indices over 4-bit hashes", n);
+}
+
+int main() {
+  for (size_t n : {size_t(1000), size_t(200000)})
+    for (size_t distinct : {size_t(10), size_t(1000), n})
+      check(n, distinct);
+  if (failures == 0)
+    printf("test_indices: ok\n");
+  return failures == 0 ? 0 : 1;
+}
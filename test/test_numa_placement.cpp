@@ -0,0 +1,45 @@
+// Bucket array placements under every scatter engine: output is a grouped
+// permutation of the input, and a Local array reused for layouts of other
+// sizes is cut into node slices of the current layout. Without libnuma
+// (SEMISORT_NUMA) or on one node every placement falls back to Naive.
+
+#include <string>
+#include <utility>
+
+#include "semisort_checks.h"
+
+static void check(NumaPlacement placement, ScatterEngine engine, const std::string &name) {
+  SemisortConfig config;
+  config.numa_placement = placement;
+  config.scatter_engine = engine;
+  config.fast_paths = false;
+  SemisortWorkspace<uint64_t, uint64_t> ws;
+  // grow, shrink and grow again on one workspace
+  for (size_t n : {size_t(200000), size_t(20000), size_t(100000), size_t(300000)}) {
+    auto in = test_input(n, n / 10);
+    auto out = in;
+    semi_sort_without_alloc(out, ws, config);
+    expect(is_grouped_permutation(in, out), name.c_str(), n);
+    if (ws.bucket_placement == NumaPlacement::Local) {
+      size_t nodes = semisort_numa_nodes();
+      expect(ws.bucket_node_size == ws.buckets_size && ws.bucket_node_span * nodes >= ws.buckets_size &&
+                 ws.bucket_node_span * (nodes - 1) < ws.buckets_size,
+             (name + ": node slices follow the layout").c_str(), n);
+    }
+  }
+}
+
+int main() {
+  const std::pair<NumaPlacement, const char *> placements[] = {
+      {NumaPlacement::Naive, "Naive"}, {NumaPlacement::Interleave, "Interleave"}, {NumaPlacement::Local, "Local"}};
+  const std::pair<ScatterEngine, const char *> engines[] = {{ScatterEngine::RandomCas, "RandomCas"},
+                                                            {ScatterEngine::CountingPlace, "CountingPlace"},
+                                                            {ScatterEngine::PrefetchCas, "PrefetchCas"},
+                                                            {ScatterEngine::StagedCas, "StagedCas"}};
+  for (auto placement : placements)
+    for (auto engine : engines)
+      check(placement.first, engine.first, std::string(placement.second) + " " + engine.second);
+  if (failures == 0)
+    printf("test_numa_placement: ok (%zu nodes)\n", semisort_numa_nodes());
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,29 @@
+// semi_sort_sharded with one, two and four worker processes: output is a
+// grouped permutation of the input, also with exact keys over a hash range
+// narrow enough that heavy keys collide with light ones
+
+#include "../src/semisort_sharded.h"
+#include "semisort_checks.h"
+
+static void check(size_t n, size_t distinct, size_t num_workers, bool exact) {
+  SemisortConfig config;
+  config.exact_keys = exact;
+  config.hash_bits = exact ? 12 : 0;
+  auto in = test_input(n, distinct, hashed_key_bits(n, config));
+  auto out = in;
+  ShardedSemisortStats stats;
+  semi_sort_sharded(out, num_workers, config, &stats);
+  expect(stats.num_workers == num_workers && is_grouped_permutation(in, out),
+         exact ? "sharded, exact keys" : "sharded", n);
+}
+
+int main() {
+  for (size_t num_workers : {size_t(1), size_t(2), size_t(4)}) {
+    check(200000, 1000, num_workers, false);
+    check(200000, 200000, num_workers, false);
+    check(200000, 5000, num_workers, true);
+  }
+  if (failures == 0)
+    printf("test_sharded: ok\n");
+  return failures == 0 ? 0 : 1;
+}
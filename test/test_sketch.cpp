@@ -0,0 +1,38 @@
+// HeavyDetection::Sketch: output is a grouped permutation of the input for
+// skewed, uniform and few key inputs under every scatter engine
+
+#include <string>
+#include <utility>
+
+#include "semisort_checks.h"
+
+static void check(size_t n, size_t distinct, ScatterEngine engine, const std::string &name) {
+  SemisortConfig config;
+  config.heavy_detection = HeavyDetection::Sketch;
+  config.scatter_engine = engine;
+  config.fast_paths = false;
+  auto in = test_input(n, distinct);
+
+  auto out = in;
+  semi_sort(out, config);
+  expect(is_grouped_permutation(in, out), name.c_str(), n);
+
+  // the sketch reads hashed keys, so semi_sort_with_hash hashes up front
+  out = in;
+  semi_sort_with_hash(out, config);
+  expect(is_grouped_permutation(in, out), (name + ": semi_sort_with_hash").c_str(), n);
+}
+
+int main() {
+  const std::pair<ScatterEngine, const char *> engines[] = {{ScatterEngine::RandomCas, "RandomCas"},
+                                                            {ScatterEngine::CountingPlace, "CountingPlace"},
+                                                            {ScatterEngine::PrefetchCas, "PrefetchCas"},
+                                                            {ScatterEngine::StagedCas, "StagedCas"}};
+  for (auto engine : engines)
+    for (size_t n : {size_t(1000), size_t(200000)})
+      for (size_t distinct : {size_t(3), size_t(1000), n})
+        check(n, distinct, engine.first, engine.second);
+  if (failures == 0)
+    printf("test_sketch: ok\n");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,38 @@
+// Stable semisorting: output is a grouped permutation of the input and every
+// group keeps its records in input order, whatever scatter engine is asked for
+// and on both the small input path and the bucket path
+
+#include <string>
+
+#include "semisort_checks.h"
+
+static bool keeps_input_order(const parlay::sequence<Record> &out) {
+  for (size_t i = 1; i < out.size(); i++)
+    if (out[i].key == out[i - 1].key && out[i].obj < out[i - 1].obj)
+      return false;
+  return true;
+}
+
+static void check(size_t n, size_t distinct, ScatterEngine engine, bool by_index) {
+  SemisortConfig config;
+  config.stable = true;
+  config.scatter_engine = engine;
+  config.sort_by_index = by_index;
+  auto in = test_input(n, distinct);
+  auto out = in;
+  semi_sort(out, config);
+  std::string what = by_index ? "stable, by index" : "stable";
+  expect(is_grouped_permutation(in, out), what.c_str(), n);
+  expect(keeps_input_order(out), (what + ": input order").c_str(), n);
+}
+
+int main() {
+  for (ScatterEngine engine : {ScatterEngine::RandomCas, ScatterEngine::StagedCas})
+    for (size_t n : {size_t(1000), size_t(200000)})
+      for (size_t distinct : {size_t(10), size_t(1000), n})
+        for (bool by_index : {false, true})
+          check(n, distinct, engine, by_index);
+  if (failures == 0)
+    printf("test_stable: ok\n");
+  return failures == 0 ? 0 : 1;
+}
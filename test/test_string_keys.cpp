@@ -0,0 +1,67 @@
+// semisort_string_keys over a key arena: the permutation holds every position
+// once and every group holds all the positions of exactly one key, also when
+// the string hash sends many keys to one value and under every scatter engine
+
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../src/semisort_string.h"
+#include "semisort_checks.h"
+
+// hashes keys by length mod 3, so distinct keys collide all the time
+struct LengthHash {
+  size_t operator()(std::string_view key) const { return key.size() % 3; }
+};
+
+static bool is_key_grouping(const StringKeyArena &keys, const SemisortIndices<uint32_t> &result) {
+  size_t n = keys.size();
+  if (result.permutation.size() != n)
+    return false;
+  std::vector<bool> seen(n, false);
+  std::set<std::string_view> grouped;
+  size_t num_groups = result.group_offsets.size();
+  for (size_t g = 0; g < num_groups; g++) {
+    size_t start = result.group_offsets[g];
+    size_t end = (g + 1 < num_groups) ? result.group_offsets[g + 1] : n;
+    if (start >= end || !grouped.insert(keys[result.permutation[start]]).second)
+      return false;
+    for (size_t j = start; j < end; j++) {
+      size_t position = result.permutation[j];
+      if (position >= n || seen[position] || keys[position] != keys[result.permutation[start]])
+        return false;
+      seen[position] = true;
+    }
+  }
+  return num_groups > 0 || n == 0;
+}
+
+static void check(size_t n, size_t distinct, ScatterEngine engine) {
+  std::string data;
+  std::vector<uint64_t> offsets = {0};
+  for (size_t i = 0; i < n; i++) {
+    size_t key = (i % 5 == 0) ? 7 : parlay::hash64(i) % distinct;
+    data += "key/" + std::string(key % 4, 'x') + std::to_string(key);
+    offsets.push_back(data.size());
+  }
+  StringKeyArena keys{data, offsets.data(), n};
+  SemisortConfig config;
+  config.scatter_engine = engine;
+
+  expect(is_key_grouping(keys, semisort_string_keys(keys, config)), "string keys", n);
+  SemisortIndexWorkspace<uint32_t, uint32_t> ws;
+  for (int call = 0; call < 2; call++)
+    expect(is_key_grouping(keys, semisort_string_keys(keys, ws, config, LengthHash())), "colliding string keys", n);
+}
+
+int main() {
+  for (ScatterEngine engine : {ScatterEngine::RandomCas, ScatterEngine::CountingPlace, ScatterEngine::PrefetchCas,
+                               ScatterEngine::StagedCas})
+    for (size_t n : {size_t(1000), size_t(100000)})
+      for (size_t distinct : {size_t(10), size_t(5000)})
+        check(n, distinct, engine);
+  if (failures == 0)
+    printf("test_string_keys: ok\n");
+  return failures == 0 ? 0 : 1;
+}